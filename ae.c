@@ -42,7 +42,11 @@
 
 #include "ae.h"
 #include "config.h"
+#include "monotonic.h"
 #include "zmalloc.h"
+#include "pool.h"
+
+static __thread objPool timeEventPool = POOL_STATIC_INIT(sizeof(aeTimeEvent));
 
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
@@ -72,13 +76,28 @@ aeCreateEventLoop(int setsize)
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
     eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
     eventLoop->timeEventNextId = 0;
+    eventLoop->timeEventIdStep = 1;
     eventLoop->timeEventSkiplist = createSkiplist();
     eventLoop->timeEventSkiplist->compare = compareTimeEvent;
+    eventLoop->timeEventWheel = NULL;
+    eventLoop->timerBackend = AE_TIMER_SKIPLIST;
+    eventLoop->restoreTail = NULL;
     eventLoop->stop = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
+    eventLoop->slowtimeproc = NULL;
+    eventLoop->slowtimeus = 0;
+    eventLoop->maxwait = -1;
+    eventLoop->stat_iterations = 0;
+    histogramReset(&eventLoop->stat_firelag);
+    eventLoop->stat_poll_us = 0;
+    eventLoop->stat_busy_us = 0;
+    eventLoop->stat_max_busy_us = 0;
+    eventLoop->wakeup = 0;
+    monotonicInit();
+    aeUpdateTime(eventLoop);
+    aeUpdateWallAnchor(eventLoop);
     if (aeApiCreate(eventLoop) == -1) goto err;
     /* Events with mask == AE_NONE are not set. So let's initialize the
      * vector with it. */
@@ -198,106 +217,359 @@ aeGetFileEvents(aeEventLoop* eventLoop, int fd)
     return fe->mask;
 }
 
-static void
-aeGetTime(long* seconds, long* milliseconds)
+/* Refresh the cached "now". Called once per aeProcessEvents iteration,
+ * before the timeout is computed and again when the poll returns, so file
+ * and time event handlers of one iteration all see the same time. */
+void
+aeUpdateTime(aeEventLoop* eventLoop)
+{
+    eventLoop->now = getMonotonicUs() / 1000;
+}
+
+/* Return the cached monotonic time in milliseconds. */
+long long
+aeMonotonicMs(aeEventLoop* eventLoop)
+{
+    return eventLoop->now;
+}
+
+/* Re-read the wall clock and re-anchor it to the monotonic clock. Pending
+ * timers are not affected, only later wall clock conversions are. */
+void
+aeUpdateWallAnchor(aeEventLoop* eventLoop)
 {
     struct timeval tv;
 
     gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec / 1000;
+    eventLoop->wallanchor = (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000 -
+                            (long long)(getMonotonicUs() / 1000);
 }
 
-static void
-aeAddMillisecondsToNow(long long milliseconds, long* sec, long* ms)
+/* Convert between unix milliseconds and the loop monotonic clock. */
+long long
+aeWallToMonotonic(aeEventLoop* eventLoop, long long unixms)
 {
-    long cur_sec, cur_ms, when_sec, when_ms;
-
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds / 1000;
-    when_ms = cur_ms + milliseconds % 1000;
-    if (when_ms >= 1000) {
-        when_sec++;
-        when_ms -= 1000;
-    }
-    *sec = when_sec;
-    *ms = when_ms;
+    return unixms - eventLoop->wallanchor;
 }
 
 long long
-aeCreateTimeEvent(aeEventLoop* eventLoop, long long unixseconds,
-                  long long milliseconds, aeTimeProc* proc, void* clientData,
-                  aeEventFinalizerProc* finalizerProc)
+aeMonotonicToWall(aeEventLoop* eventLoop, long long ms)
 {
-    long long id = eventLoop->timeEventNextId++;
-    aeTimeEvent* te;
+    return ms + eventLoop->wallanchor;
+}
 
-    te = zmalloc(sizeof(*te));
-    if (te == NULL) return AE_ERR;
+/* Select the store used for time events. This must be called before the
+ * first time event is created. */
+int
+aeSetTimerBackend(aeEventLoop* eventLoop, int backend)
+{
+    if (eventLoop->timeEventSkiplist->length ||
+        (eventLoop->timeEventWheel && eventLoop->timeEventWheel->length))
+        return AE_ERR;
+    if (backend == AE_TIMER_WHEEL && eventLoop->timeEventWheel == NULL)
+        eventLoop->timeEventWheel = createTimeWheel(eventLoop->now);
+    eventLoop->timerBackend = backend;
+    return AE_OK;
+}
+
+/* Ids of the time events created from now on are first, first + step,
+ * first + 2 * step and so on. Loops sharing a process use the same step and
+ * a different first id, so an id alone tells which loop owns the event. */
+void
+aeSetTimeEventIdSpace(aeEventLoop* eventLoop, long long first, long long step)
+{
+    eventLoop->timeEventNextId = first;
+    eventLoop->timeEventIdStep = step;
+}
+
+static void
+aeLinkTimeEvent(aeEventLoop* eventLoop, aeTimeEvent* te, long long id,
+                long long when, aeTimeProc* proc, void* clientData,
+                aeEventFinalizerProc* finalizerProc)
+{
     te->id = id;
-    aeAddMillisecondsToNow(milliseconds, &te->when_sec, &te->when_ms);
+    te->when = when;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->next = NULL;
-    skiplistInsert(eventLoop->timeEventSkiplist, unixseconds, (void*)te, id);
+    te->flags = 0;
+    if (eventLoop->timerBackend == AE_TIMER_WHEEL)
+        timeWheelInsert(eventLoop->timeEventWheel, when, te, id);
+    else if (eventLoop->restoreTail)
+        skiplistAppend(eventLoop->timeEventSkiplist, eventLoop->restoreTail,
+                       when, (void*)te, id);
+    else
+        skiplistInsert(eventLoop->timeEventSkiplist, when, (void*)te, id);
+}
+
+/* Schedule 'te', a time event whose memory is owned by the caller, at
+ * 'when'. This lets the caller embed the event in its own record instead of
+ * allocating one more object per timer. The memory must stay valid until
+ * the finalizer is called, which is where the caller can release it. */
+long long
+aeAddTimeEvent(aeEventLoop* eventLoop, aeTimeEvent* te, long long when,
+               aeTimeProc* proc, void* clientData,
+               aeEventFinalizerProc* finalizerProc)
+{
+    long long id = eventLoop->timeEventNextId;
+
+    eventLoop->timeEventNextId += eventLoop->timeEventIdStep;
+    aeLinkTimeEvent(eventLoop, te, id, when, proc, clientData, finalizerProc);
     return id;
 }
 
+/* Like aeAddTimeEvent() but with the id the event had before, when it is
+ * reloaded from disk. Ids created later never collide with it. Returns
+ * AE_ERR if the id is not in the id space of the loop or is already used. */
 int
-aeDeleteTimeEvent(aeEventLoop* eventLoop, long long score, long long id)
+aeRestoreTimeEvent(aeEventLoop* eventLoop, aeTimeEvent* te, long long id,
+                   long long when, aeTimeProc* proc, void* clientData,
+                   aeEventFinalizerProc* finalizerProc)
+{
+    long long step = eventLoop->timeEventIdStep;
+    void* found;
+
+    if (id < 0 || id % step != eventLoop->timeEventNextId % step)
+        return AE_ERR;
+    if (eventLoop->timerBackend == AE_TIMER_WHEEL)
+        found = intMapFind(eventLoop->timeEventWheel->ids, id);
+    else
+        found = skiplistFindById(eventLoop->timeEventSkiplist, id);
+    if (found) return AE_ERR;
+
+    if (id >= eventLoop->timeEventNextId)
+        eventLoop->timeEventNextId = id + step;
+    aeLinkTimeEvent(eventLoop, te, id, when, proc, clientData, finalizerProc);
+    return AE_OK;
+}
+
+/* Prepare to restore about 'count' time events, ideally in (when, id)
+ * order: the id index is sized once and the skiplist links each event
+ * after the last one instead of searching its place. Until aeEndRestore()
+ * time events can be added but not deleted. */
+void
+aeBeginRestore(aeEventLoop* eventLoop, unsigned long count)
+{
+    if (eventLoop->timerBackend == AE_TIMER_WHEEL) {
+        intMapExpand(eventLoop->timeEventWheel->ids, count);
+    } else {
+        skiplist* sl = eventLoop->timeEventSkiplist;
+
+        intMapExpand(sl->ids, count);
+        eventLoop->restoreTail = zmalloc(sizeof(skiplistTail));
+        skiplistTailInit(sl, eventLoop->restoreTail);
+    }
+}
+
+/* Hint that time event 'id' is restored soon. Restoring millions of events
+ * is bound by cache misses on the id index, fetching the slot a few events
+ * ahead hides them. */
+void
+aePrefetchTimeEvent(aeEventLoop* eventLoop, long long id)
 {
-    return skiplistDelete(eventLoop->timeEventSkiplist, score, id);
+    if (eventLoop->timerBackend == AE_TIMER_WHEEL)
+        intMapPrefetch(eventLoop->timeEventWheel->ids, id);
+    else
+        intMapPrefetch(eventLoop->timeEventSkiplist->ids, id);
+}
+
+void
+aeEndRestore(aeEventLoop* eventLoop)
+{
+    zfree(eventLoop->restoreTail);
+    eventLoop->restoreTail = NULL;
+}
+
+/* Create a time event firing at 'when', in milliseconds of the loop
+ * monotonic clock (see aeMonotonicMs and aeWallToMonotonic). */
+long long
+aeCreateTimeEvent(aeEventLoop* eventLoop, long long when, aeTimeProc* proc,
+                  void* clientData, aeEventFinalizerProc* finalizerProc)
+{
+    aeTimeEvent* te = poolAlloc(&timeEventPool);
+    long long id;
+
+    id = aeAddTimeEvent(eventLoop, te, when, proc, clientData, finalizerProc);
+    te->flags = AE_TIME_EVENT_POOLED;
+    return id;
+}
+
+/* Call the finalizer of an unlinked time event and release it. The flags
+ * are read first, the finalizer may free an event it embeds. */
+static void
+aeFreeTimeEvent(aeEventLoop* eventLoop, aeTimeEvent* te)
+{
+    int pooled = te->flags & AE_TIME_EVENT_POOLED;
+
+    if (te->finalizerProc) te->finalizerProc(eventLoop, te->clientData);
+    if (pooled) poolFree(&timeEventPool, te);
+}
+
+int
+aeDeleteTimeEvent(aeEventLoop* eventLoop, long long id)
+{
+    if (eventLoop->timerBackend == AE_TIMER_WHEEL) {
+        aeTimeEvent* te = timeWheelDelete(eventLoop->timeEventWheel, id);
+
+        if (te == NULL) return 0;
+        aeFreeTimeEvent(eventLoop, te);
+        return 1;
+    } else {
+        skiplist* sl = eventLoop->timeEventSkiplist;
+        skiplistNode* x = skiplistFindById(sl, id);
+        aeTimeEvent* te;
+
+        if (x == NULL) return 0;
+        skiplistUnlink(sl, x->score, id);
+        te = x->obj;
+        freeSkiplistNode(x);
+        aeFreeTimeEvent(eventLoop, te);
+        return 1;
+    }
+}
+
+unsigned long
+aePendingTimeEvents(aeEventLoop* eventLoop)
+{
+    if (eventLoop->timerBackend == AE_TIMER_WHEEL)
+        return eventLoop->timeEventWheel->length;
+    return eventLoop->timeEventSkiplist->length;
+}
+
+/* Call 'proc' for every pending time event, in no particular order. Time
+ * events must not be created or deleted until it returns. */
+void
+aeForEachTimeEvent(aeEventLoop* eventLoop, aeTimeEventVisitor* proc,
+                   void* privdata)
+{
+    if (eventLoop->timerBackend == AE_TIMER_WHEEL) {
+        intMap* ids = eventLoop->timeEventWheel->ids;
+        unsigned long j;
+
+        for (j = 0; j < ids->size; j++) {
+            timeWheelNode* node = ids->table[j].val;
+            if (node) proc(node->obj, privdata);
+        }
+    } else {
+        skiplistNode* x = eventLoop->timeEventSkiplist->header;
+
+        while ((x = x->level[0].forward) != NULL)
+            proc(x->obj, privdata);
+    }
 }
 
 /* Search the first timer to fire.
  * This operation is useful to know how many time the select can be
  * put in sleep without to delay any event.
- * If there are no timers NULL is returned.
+ * Returns the deadline in monotonic milliseconds, or -1 if there are no
+ * timers.
  *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
-static aeTimeEvent*
+ * With the skiplist the nearest timer is just the head. The timing wheel
+ * may return an earlier deadline, when its next slot has to be cascaded. */
+static long long
 aeSearchNearestTimer(aeEventLoop* eventLoop)
 {
-    if (!eventLoop->timeEventSkiplist->header->level[0].forward) return NULL;
-    return (aeTimeEvent*)eventLoop->timeEventSkiplist->header->level[0]
-      .forward->obj;
+    skiplistNode* head;
+
+    if (eventLoop->timerBackend == AE_TIMER_WHEEL)
+        return timeWheelNearest(eventLoop->timeEventWheel);
+    head = eventLoop->timeEventSkiplist->header->level[0].forward;
+    return head ? head->score : -1;
+}
+
+/* Account how late a timer due at 'when' ms fires. The clock is sampled
+ * again for each timer, the callbacks before it delay it too. Returns the
+ * sample, the start of the callback. */
+static monotime
+recordFireLag(aeEventLoop* eventLoop, long long when)
+{
+    monotime now = getMonotonicUs();
+    long long lag = (long long)now - when * 1000;
+
+    histogramRecord(&eventLoop->stat_firelag, lag > 0 ? lag : 0);
+    return now;
+}
+
+/* Report the callback of 'te', started at 'start', if it was slow. */
+static void
+checkSlowTimeProc(aeEventLoop* eventLoop, aeTimeEvent* te, monotime start)
+{
+    long long duration;
+
+    if (!eventLoop->slowtimeproc) return;
+    duration = (long long)(getMonotonicUs() - start);
+    if (duration >= eventLoop->slowtimeus)
+        eventLoop->slowtimeproc(eventLoop, te, duration);
 }
 
-/* Process time events */
+/* Fire the timers the wheel found expired. Only the ones expired on entry
+ * are processed, a repeat timer rescheduled in the past waits for the next
+ * iteration. */
 static int
-processTimeEvents(aeEventLoop* eventLoop)
+processWheelTimeEvents(aeEventLoop* eventLoop, long long now)
 {
+    timeWheel* tw = eventLoop->timeEventWheel;
+    unsigned long pending;
     int processed = 0;
-    aeTimeEvent* te;
 
-    long now_sec, now_ms;
-    long long id;
-    aeGetTime(&now_sec, &now_ms);
+    timeWheelExpire(tw, now);
+    pending = tw->nexpired;
+    while (pending-- && tw->expired) {
+        timeWheelNode* node = tw->expired;
+        aeTimeEvent* te = node->obj;
+        long long id = te->id;
+        monotime start;
+        int retval;
 
-    skiplistNode* x = eventLoop->timeEventSkiplist->header;
-    if (x->level[0].forward == NULL) return processed;
-    x = x->level[0].forward;
-    te = (aeTimeEvent*)x->obj;
+        start = recordFireLag(eventLoop, te->when);
+        retval = te->timeProc(eventLoop, id, te->clientData);
+        checkSlowTimeProc(eventLoop, te, start);
+        processed++;
+        if (retval != AE_NOMORE) {
+            timeWheelReschedule(tw, node, te->when = now + retval);
+        } else {
+            aeDeleteTimeEvent(eventLoop, id);
+        }
+    }
+    return processed;
+}
 
-    while (te && (now_sec > te->when_sec ||
-                  (now_sec == te->when_sec && now_ms >= te->when_ms))) {
+/* Process time events. Every due timer is fired in a single pass against
+ * the cached clock sample of this iteration. Callbacks only queue their
+ * work (worker messages are written in batch before the loop sleeps
+ * again). */
+static int
+processTimeEvents(aeEventLoop* eventLoop)
+{
+    skiplist* sl = eventLoop->timeEventSkiplist;
+    unsigned long pending = sl->length;
+    int processed = 0;
+    long long now = eventLoop->now;
+    skiplistNode* x;
+
+    if (eventLoop->timerBackend == AE_TIMER_WHEEL)
+        return processWheelTimeEvents(eventLoop, now);
+
+    /* The head is always the nearest timer. A repeat timer is moved to its
+     * new score right away, so the list stays sorted and the next head is
+     * valid even after the callback. 'pending' bounds the loop so that a
+     * timer rescheduled into the past fires at the next iteration. */
+    while (pending-- && (x = sl->header->level[0].forward) &&
+           x->score <= now) {
+        aeTimeEvent* te = x->obj;
+        long long id = te->id, score = x->score;
+        monotime start;
         int retval;
-        id = te->id;
+
+        start = recordFireLag(eventLoop, score);
         retval = te->timeProc(eventLoop, id, te->clientData);
+        checkSlowTimeProc(eventLoop, te, start);
         processed++;
         if (retval != AE_NOMORE) {
-            aeAddMillisecondsToNow(retval, &te->when_sec, &te->when_ms);
+            skiplistUpdateScore(sl, score, id, te->when = now + retval);
         } else {
-            aeDeleteTimeEvent(eventLoop, x->score, x->id);
+            aeDeleteTimeEvent(eventLoop, id);
         }
-        x = x->level[0].forward;
-        te = x ? (aeTimeEvent*)x->obj : NULL;
     }
     return processed;
 }
@@ -322,6 +594,7 @@ aeProcessEvents(aeEventLoop* eventLoop, int flags)
 
     /* Nothing to do? return ASAP */
     if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
+    aeUpdateTime(eventLoop);
 
     /* Note that we want call select() even if there are no
      * file events to process as long as we want to process time
@@ -330,27 +603,25 @@ aeProcessEvents(aeEventLoop* eventLoop, int flags)
     if (eventLoop->maxfd != -1 ||
         ((flags & AE_TIME_EVENTS) && !(flags & AE_DONT_WAIT))) {
         int j;
-        aeTimeEvent* shortest = NULL;
+        long long shortest = -1;
         struct timeval tv, *tvp;
+        monotime sleep;
 
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
-        if (shortest) {
-            long now_sec, now_ms;
-
+        if (!(flags & AE_DONT_WAIT) && eventLoop->maxwait != -1 &&
+            (shortest == -1 ||
+             shortest - eventLoop->now > eventLoop->maxwait))
+            shortest = eventLoop->now + eventLoop->maxwait;
+        if (shortest != -1) {
             /* Calculate the time missing for the nearest
              * timer to fire. */
-            aeGetTime(&now_sec, &now_ms);
+            long long ms = shortest - eventLoop->now;
+
+            if (ms < 0) ms = 0;
             tvp = &tv;
-            tvp->tv_sec = shortest->when_sec - now_sec;
-            if (shortest->when_ms < now_ms) {
-                tvp->tv_usec = ((shortest->when_ms + 1000) - now_ms) * 1000;
-                tvp->tv_sec--;
-            } else {
-                tvp->tv_usec = (shortest->when_ms - now_ms) * 1000;
-            }
-            if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-            if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+            tvp->tv_sec = ms / 1000;
+            tvp->tv_usec = (ms % 1000) * 1000;
         } else {
             /* If we have to check for events but need to return
              * ASAP because of AE_DONT_WAIT we need to set the timeout
@@ -364,7 +635,21 @@ aeProcessEvents(aeEventLoop* eventLoop, int flags)
             }
         }
 
+        /* Everything done since the last wake up is the busy time of an
+         * iteration, the poll call is the time it waited. */
+        sleep = getMonotonicUs();
+        if (eventLoop->wakeup) {
+            long long busy = sleep - eventLoop->wakeup;
+
+            eventLoop->stat_busy_us += busy;
+            if (busy > eventLoop->stat_max_busy_us)
+                eventLoop->stat_max_busy_us = busy;
+        }
         numevents = aeApiPoll(eventLoop, tvp);
+        eventLoop->wakeup = getMonotonicUs();
+        eventLoop->now = eventLoop->wakeup / 1000;
+        eventLoop->stat_poll_us += eventLoop->wakeup - sleep;
+        eventLoop->stat_iterations++;
         for (j = 0; j < numevents; j++) {
             aeFileEvent* fe = &eventLoop->events[eventLoop->fired[j].fd];
             int mask = eventLoop->fired[j].mask;
@@ -436,3 +721,21 @@ aeSetBeforeSleepProc(aeEventLoop* eventLoop, aeBeforeSleepProc* beforesleep)
 {
     eventLoop->beforesleep = beforesleep;
 }
+
+/* Call 'proc' after every time event callback that took 'us' microseconds
+ * or more. A NULL 'proc' turns it off, and the callbacks are not timed. */
+void
+aeSetSlowTimeProc(aeEventLoop* eventLoop, aeSlowTimeProc* proc, long long us)
+{
+    eventLoop->slowtimeproc = proc;
+    eventLoop->slowtimeus = us;
+}
+
+/* Never block in the poll call for more than 'milliseconds', so that the
+ * before sleep callback runs at least that often on an idle loop. -1, the
+ * default, waits for as long as no event is due. */
+void
+aeSetMaxWait(aeEventLoop* eventLoop, long long milliseconds)
+{
+    eventLoop->maxwait = milliseconds;
+}
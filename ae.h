@@ -47,12 +47,22 @@
 
 #define AE_NOMORE -1
 
+/* Time event flags */
+#define AE_TIME_EVENT_POOLED 1 /* allocated by aeCreateTimeEvent */
+
+/* Time event stores */
+#define AE_TIMER_SKIPLIST 0
+#define AE_TIMER_WHEEL 1
+
 /* Macros */
 #define AE_NOTUSED(V) ((void)V)
 
+#include "histogram.h"
 #include "skiplist.h"
+#include "timewheel.h"
 
 struct aeEventLoop;
+struct aeTimeEvent;
 
 /* Types and data structures */
 typedef void aeFileProc(struct aeEventLoop* eventLoop, int fd, void* clientData,
@@ -62,6 +72,9 @@ typedef int aeTimeProc(struct aeEventLoop* eventLoop, long long id,
 typedef void aeEventFinalizerProc(struct aeEventLoop* eventLoop,
                                   void* clientData);
 typedef void aeBeforeSleepProc(struct aeEventLoop* eventLoop);
+typedef void aeTimeEventVisitor(struct aeTimeEvent* te, void* privdata);
+typedef void aeSlowTimeProc(struct aeEventLoop* eventLoop,
+                            struct aeTimeEvent* te, long long duration);
 
 /* File event structure */
 typedef struct aeFileEvent
@@ -75,13 +88,12 @@ typedef struct aeFileEvent
 /* Time event structure */
 typedef struct aeTimeEvent
 {
-    long long id;  /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms;  /* milliseconds */
+    long long id;   /* time event identifier. */
+    long long when; /* deadline, monotonic milliseconds */
     aeTimeProc* timeProc;
     aeEventFinalizerProc* finalizerProc;
     void* clientData;
-    struct aeTimeEvent* next;
+    int flags;
 } aeTimeEvent;
 
 /* A fired event */
@@ -97,14 +109,29 @@ typedef struct aeEventLoop
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
+    long long timeEventIdStep; /* ids are timeEventNextId + k * step */
+    long long now;        /* cached monotonic milliseconds */
+    long long wallanchor; /* unix milliseconds at monotonic time zero */
     time_t lastTime;     /* Used to detect system clock skew */
     aeFileEvent* events; /* Registered events */
     aeFiredEvent* fired; /* Fired events */
-    aeTimeEvent* timeEventHead;
+    int timerBackend; /* AE_TIMER_SKIPLIST or AE_TIMER_WHEEL */
     skiplist* timeEventSkiplist;
+    timeWheel* timeEventWheel;
+    skiplistTail* restoreTail; /* between aeBeginRestore and aeEndRestore */
     int stop;
     void* apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc* beforesleep;
+    aeSlowTimeProc* slowtimeproc; /* callbacks longer than slowtimeus */
+    long long slowtimeus;
+    long long maxwait; /* longest poll timeout in ms, -1 for none */
+    /* Statistics, only written by the thread running the loop */
+    long long stat_iterations;
+    long long stat_poll_us;     /* time spent waiting in the poll call */
+    long long stat_busy_us;     /* time between waking up and polling again */
+    long long stat_max_busy_us; /* longest iteration */
+    unsigned long long wakeup;  /* monotonic us, end of the last poll */
+    histogram stat_firelag;     /* us between deadline and firing */
 } aeEventLoop;
 
 /* Prototypes */
@@ -116,17 +143,39 @@ int aeCreateFileEvent(aeEventLoop* eventLoop, int fd, int mask,
                       aeFileProc* proc, void* clientData);
 void aeDeleteFileEvent(aeEventLoop* eventLoop, int fd, int mask);
 int aeGetFileEvents(aeEventLoop* eventLoop, int fd);
-long long aeCreateTimeEvent(aeEventLoop* eventLoop, long long unixSeconds,
-                            long long milliseconds, aeTimeProc* proc,
-                            void* clientData,
+long long aeCreateTimeEvent(aeEventLoop* eventLoop, long long when,
+                            aeTimeProc* proc, void* clientData,
                             aeEventFinalizerProc* finalizerProc);
-int aeDeleteTimeEvent(aeEventLoop* eventLoop, long long score, long long id);
+long long aeAddTimeEvent(aeEventLoop* eventLoop, aeTimeEvent* te,
+                         long long when, aeTimeProc* proc, void* clientData,
+                         aeEventFinalizerProc* finalizerProc);
+int aeRestoreTimeEvent(aeEventLoop* eventLoop, aeTimeEvent* te, long long id,
+                       long long when, aeTimeProc* proc, void* clientData,
+                       aeEventFinalizerProc* finalizerProc);
+void aeBeginRestore(aeEventLoop* eventLoop, unsigned long count);
+void aePrefetchTimeEvent(aeEventLoop* eventLoop, long long id);
+void aeEndRestore(aeEventLoop* eventLoop);
+int aeDeleteTimeEvent(aeEventLoop* eventLoop, long long id);
+unsigned long aePendingTimeEvents(aeEventLoop* eventLoop);
+void aeForEachTimeEvent(aeEventLoop* eventLoop, aeTimeEventVisitor* proc,
+                        void* privdata);
+int aeSetTimerBackend(aeEventLoop* eventLoop, int backend);
+void aeSetTimeEventIdSpace(aeEventLoop* eventLoop, long long first,
+                           long long step);
+void aeUpdateTime(aeEventLoop* eventLoop);
+long long aeMonotonicMs(aeEventLoop* eventLoop);
+void aeUpdateWallAnchor(aeEventLoop* eventLoop);
+long long aeWallToMonotonic(aeEventLoop* eventLoop, long long unixms);
+long long aeMonotonicToWall(aeEventLoop* eventLoop, long long ms);
 int aeProcessEvents(aeEventLoop* eventLoop, int flags);
 int aeWait(int fd, int mask, long long milliseconds);
 void aeMain(aeEventLoop* eventLoop);
 char* aeGetApiName(void);
 void aeSetBeforeSleepProc(aeEventLoop* eventLoop,
                           aeBeforeSleepProc* beforesleep);
+void aeSetSlowTimeProc(aeEventLoop* eventLoop, aeSlowTimeProc* proc,
+                       long long us);
+void aeSetMaxWait(aeEventLoop* eventLoop, long long milliseconds);
 int aeGetSetSize(aeEventLoop* eventLoop);
 int aeResizeSetSize(aeEventLoop* eventLoop, int setsize);
 #endif
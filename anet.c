@@ -108,27 +108,50 @@ int anetResolve(char *err, char *host, char *ipbuf)
 {
     struct sockaddr_in sa;
 
-    sa.sin_family = AF_INET;
-    if (inet_aton(host, &sa.sin_addr) == 0) {
-        struct hostent *he;
+    if (anetTcpResolve(err, host, 0, &sa, 0) == ANET_ERR)
+        return ANET_ERR;
+    inet_ntop(AF_INET, &sa.sin_addr, ipbuf, INET_ADDRSTRLEN);
+    return ANET_OK;
+}
 
-        he = gethostbyname(host);
-        if (he == NULL) {
-            anetSetError(err, "can't resolve: %s\n", host);
-            return ANET_ERR;
-        }
-        memcpy(&sa.sin_addr, he->h_addr, sizeof(struct in_addr));
+/* Fill 'sa' with the address of host:port, so that it can be connected to
+ * many times without resolving the host again. A dotted quad is parsed in
+ * place. A host name is looked up with getaddrinfo(), which is thread safe
+ * but may block for as long as the resolver takes: with ANET_IP_ONLY it is
+ * an error instead. */
+int anetTcpResolve(char *err, char *host, int port, struct sockaddr_in *sa,
+                   int flags)
+{
+    struct addrinfo hints, *info;
+    int rv;
+
+    memset(sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &sa->sin_addr) == 1) return ANET_OK;
+    if (flags & ANET_IP_ONLY) {
+        anetSetError(err, "not an IPv4 address: %s\n", host);
+        return ANET_ERR;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rv = getaddrinfo(host, NULL, &hints, &info)) != 0) {
+        anetSetError(err, "can't resolve %s: %s\n", host, gai_strerror(rv));
+        return ANET_ERR;
     }
-    strcpy(ipbuf,inet_ntoa(sa.sin_addr));
+    sa->sin_addr = ((struct sockaddr_in*)info->ai_addr)->sin_addr;
+    freeaddrinfo(info);
     return ANET_OK;
 }
 
 #define ANET_CONNECT_NONE 0
 #define ANET_CONNECT_NONBLOCK 1
-static int anetTcpGenericConnect(char *err, char *addr, int port, int flags)
+static int anetTcpGenericConnectAddr(char *err, const struct sockaddr_in *sa,
+                                     int flags)
 {
     int s, on = 1;
-    struct sockaddr_in sa;
 
     if ((s = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         anetSetError(err, "creating socket: %s\n", strerror(errno));
@@ -138,24 +161,13 @@ static int anetTcpGenericConnect(char *err, char *addr, int port, int flags)
      * will be able to close/open sockets a zillion of times */
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
 
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(port);
-    if (inet_aton(addr, &sa.sin_addr) == 0) {
-        struct hostent *he;
-
-        he = gethostbyname(addr);
-        if (he == NULL) {
-            anetSetError(err, "can't resolve: %s\n", addr);
+    if (flags & ANET_CONNECT_NONBLOCK) {
+        if (anetNonBlock(err,s) != ANET_OK) {
             close(s);
             return ANET_ERR;
         }
-        memcpy(&sa.sin_addr, he->h_addr, sizeof(struct in_addr));
     }
-    if (flags & ANET_CONNECT_NONBLOCK) {
-        if (anetNonBlock(err,s) != ANET_OK)
-            return ANET_ERR;
-    }
-    if (connect(s, (struct sockaddr*)&sa, sizeof(sa)) == -1) {
+    if (connect(s, (const struct sockaddr*)sa, sizeof(*sa)) == -1) {
         if (errno == EINPROGRESS &&
             flags & ANET_CONNECT_NONBLOCK)
             return s;
@@ -167,6 +179,15 @@ static int anetTcpGenericConnect(char *err, char *addr, int port, int flags)
     return s;
 }
 
+static int anetTcpGenericConnect(char *err, char *addr, int port, int flags)
+{
+    struct sockaddr_in sa;
+
+    if (anetTcpResolve(err, addr, port, &sa, 0) == ANET_ERR)
+        return ANET_ERR;
+    return anetTcpGenericConnectAddr(err, &sa, flags);
+}
+
 int anetTcpConnect(char *err, char *addr, int port)
 {
     return anetTcpGenericConnect(err,addr,port,ANET_CONNECT_NONE);
@@ -177,6 +198,12 @@ int anetTcpNonBlockConnect(char *err, char *addr, int port)
     return anetTcpGenericConnect(err,addr,port,ANET_CONNECT_NONBLOCK);
 }
 
+/* Like anetTcpNonBlockConnect() with an address from anetTcpResolve(). */
+int anetTcpNonBlockConnectAddr(char *err, const struct sockaddr_in *sa)
+{
+    return anetTcpGenericConnectAddr(err,sa,ANET_CONNECT_NONBLOCK);
+}
+
 /* Like read(2) but make sure 'count' is read before to return
  * (unless error or EOF condition is encountered) */
 int anetRead(int fd, char *buf, int count)
@@ -207,7 +234,9 @@ int anetWrite(int fd, char *buf, int count)
     return totlen;
 }
 
-int anetTcpServer(char *err, int port, char *bindaddr)
+#define ANET_SERVER_NONE 0
+#define ANET_SERVER_REUSEPORT 1
+static int anetTcpGenericServer(char *err, int port, char *bindaddr, int flags)
 {
     int s, on = 1;
     struct sockaddr_in sa;
@@ -221,6 +250,19 @@ int anetTcpServer(char *err, int port, char *bindaddr)
         close(s);
         return ANET_ERR;
     }
+    if (flags & ANET_SERVER_REUSEPORT) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+            anetSetError(err, "setsockopt SO_REUSEPORT: %s\n", strerror(errno));
+            close(s);
+            return ANET_ERR;
+        }
+#else
+        anetSetError(err, "SO_REUSEPORT is not supported\n");
+        close(s);
+        return ANET_ERR;
+#endif
+    }
     memset(&sa,0,sizeof(sa));
     sa.sin_family = AF_INET;
     sa.sin_port = htons(port);
@@ -245,6 +287,18 @@ int anetTcpServer(char *err, int port, char *bindaddr)
     return s;
 }
 
+int anetTcpServer(char *err, int port, char *bindaddr)
+{
+    return anetTcpGenericServer(err,port,bindaddr,ANET_SERVER_NONE);
+}
+
+/* Like anetTcpServer but with SO_REUSEPORT set, so that several sockets can
+ * listen on the same address and the kernel spreads connections among them. */
+int anetTcpReusePortServer(char *err, int port, char *bindaddr)
+{
+    return anetTcpGenericServer(err,port,bindaddr,ANET_SERVER_REUSEPORT);
+}
+
 int anetAccept(char *err, int serversock, char *ip, int *port)
 {
     int fd;
@@ -35,11 +35,20 @@
 #define ANET_ERR -1
 #define ANET_ERR_LEN 256
 
+/* Flags for anetTcpResolve() */
+#define ANET_IP_ONLY (1<<0) /* don't look up host names */
+
+struct sockaddr_in;
+
 int anetTcpConnect(char *err, char *addr, int port);
 int anetTcpNonBlockConnect(char *err, char *addr, int port);
+int anetTcpNonBlockConnectAddr(char *err, const struct sockaddr_in *sa);
+int anetTcpResolve(char *err, char *host, int port, struct sockaddr_in *sa,
+                   int flags);
 int anetRead(int fd, char *buf, int count);
 int anetResolve(char *err, char *host, char *ipbuf);
 int anetTcpServer(char *err, int port, char *bindaddr);
+int anetTcpReusePortServer(char *err, int port, char *bindaddr);
 int anetAccept(char *err, int serversock, char *ip, int *port);
 int anetWrite(int fd, char *buf, int count);
 int anetNonBlock(char *err, int fd);
@@ -0,0 +1,615 @@
+/* Append only file.
+ *
+ * Every change to the set of pending tasks is logged as a RESP array:
+ *
+ *   task <id> <once|repeat> <interval> <deadline> <addr:port> <payload>
+ *   del <id>
+ *
+ * The deadline is absolute, in unix milliseconds, so a task reloaded after
+ * a restart fires when it was meant to, or right away if that time passed
+ * while the server was down. A once task logs a del when it fires.
+ *
+ * Records are appended to a per shard buffer while commands run and the
+ * buffer is written from beforeSleep, before the replies go out. All the
+ * commands of one event loop iteration share a single write and, with
+ * --appendfsync always, a single fsync (group commit). With a period the
+ * fsync is done by a background thread, and with no it is left to the
+ * kernel. Shards append to the same file, each write holds aof_lock so
+ * records of different shards never interleave.
+ *
+ * As cancelled and fired tasks stay in the log, it is rewritten in the
+ * background once it doubled since the last rewrite, or on BGREWRITEAOF.
+ * The first shard pauses the others and forks (see child.c); the child
+ * writes one task record per pending task to a temporary file while the
+ * shards go on, appending what they log to aof_rewrite_buf as well. When
+ * the child is done the buffer is appended to the new file, which replaces
+ * the old one. */
+
+#include "server.h"
+#include "config.h"
+
+#include <sys/stat.h>
+
+#define AOF_MAX_ARGS 7
+
+/* Only give memory back to the allocator when the buffer grew past this. */
+#define AOF_BUF_SHRINK (64 * 1024)
+
+/* Records are formatted on every rpc, so stay away from printf. */
+static sds
+catAppendOnlyBulkHeader(sds buf, size_t len)
+{
+    char hdr[32];
+    int hdrlen;
+
+    hdr[0] = '$';
+    hdrlen = 1 + ll2string(hdr + 1, sizeof(hdr) - 3, len);
+    hdr[hdrlen++] = '\r';
+    hdr[hdrlen++] = '\n';
+    return sdscatlen(buf, hdr, hdrlen);
+}
+
+static sds
+catAppendOnlyBulk(sds buf, const char* s, size_t len)
+{
+    buf = catAppendOnlyBulkHeader(buf, len);
+    buf = sdscatlen(buf, (void*)s, len);
+    return sdscatlen(buf, "\r\n", 2);
+}
+
+static sds
+catAppendOnlyLongLong(sds buf, long long value)
+{
+    char num[32];
+    int len = ll2string(num, sizeof(num), value);
+
+    return catAppendOnlyBulk(buf, num, len);
+}
+
+/* Format 'task' of shard 's' as a task record. */
+static sds
+catAppendOnlyTask(sds buf, taskShard* s, taskRecord* task)
+{
+    workerPool* pool = s->endpoints[task->endpoint];
+    long long deadline = aeMonotonicToWall(s->el, task->te.when);
+    char port[16];
+    int portlen = ll2string(port, sizeof(port), pool->port);
+
+    buf = sdscatlen(buf, "*7\r\n$4\r\ntask\r\n", 14);
+    buf = catAppendOnlyLongLong(buf, task->te.id);
+    buf = task->type == TASK_ONCE ? catAppendOnlyBulk(buf, "once", 4)
+                                  : catAppendOnlyBulk(buf, "repeat", 6);
+    buf = catAppendOnlyLongLong(buf, task->interval);
+    buf = catAppendOnlyLongLong(buf, deadline);
+    buf = catAppendOnlyBulkHeader(buf, sdslen(pool->addr) + 1 + portlen);
+    buf = sdscatlen(buf, pool->addr, sdslen(pool->addr));
+    buf = sdscatlen(buf, ":", 1);
+    buf = sdscatlen(buf, port, portlen);
+    buf = sdscatlen(buf, "\r\n", 2);
+    /* The message is already a bulk string. */
+    return sdscatlen(buf, task->msg, task->msglen);
+}
+
+void
+feedAppendOnlyFileTask(taskRecord* task)
+{
+    if (server.aof_fd == -1) return;
+    myshard->aofbuf = catAppendOnlyTask(myshard->aofbuf, myshard, task);
+}
+
+void
+feedAppendOnlyFileDel(long long id)
+{
+    if (server.aof_fd == -1) return;
+    myshard->aofbuf = sdscatlen(myshard->aofbuf, "*2\r\n$3\r\ndel\r\n", 13);
+    myshard->aofbuf = catAppendOnlyLongLong(myshard->aofbuf, id);
+}
+
+/* Like write(2) but retry until everything is written or an error occurs.
+ * Returns the bytes written, which is less than 'len' on error. */
+ssize_t
+aofWrite(int fd, const char* buf, size_t len)
+{
+    size_t totwritten = 0;
+
+    while (totwritten < len) {
+        ssize_t nwritten = write(fd, buf + totwritten, len - totwritten);
+
+        if (nwritten <= 0) {
+            if (nwritten == -1 && errno == EINTR) continue;
+            break;
+        }
+        totwritten += nwritten;
+    }
+    return totwritten;
+}
+
+/* Write the records buffered by the current shard. Called before sleeping,
+ * before the replies are written, so with the always policy a client is
+ * only told about a change once it is on disk. */
+void
+flushAppendOnlyFile(void)
+{
+    taskShard* s = myshard;
+    size_t len = sdslen(s->aofbuf);
+    ssize_t nwritten;
+    int rewrite = 0;
+
+    if (len == 0) return;
+
+    pthread_mutex_lock(&server.aof_lock);
+    nwritten = aofWrite(server.aof_fd, s->aofbuf, len);
+    if (nwritten != (ssize_t)len) {
+        int saved_errno = errno;
+
+        /* Remove the partial record so the next attempt writes it whole. If
+         * that fails too, keep going from where the write stopped. */
+        if (nwritten > 0) {
+            if (ftruncate(server.aof_fd, server.aof_current_size) == -1) {
+                server.aof_current_size += nwritten;
+                if (server.aof_child_pid != -1)
+                    server.aof_rewrite_buf = sdscatlen(server.aof_rewrite_buf,
+                                                       s->aofbuf, nwritten);
+                s->aofbuf = sdsrange(s->aofbuf, nwritten, -1);
+            }
+        }
+        pthread_mutex_unlock(&server.aof_lock);
+        redisLog(REDIS_WARNING, "Error writing to the AOF: %s",
+                 strerror(saved_errno));
+        if (server.appendfsync == AOF_FSYNC_ALWAYS) {
+            redisLog(REDIS_WARNING,
+                     "Can't recover from AOF write errors with the always "
+                     "fsync policy. Exiting...");
+            exit(1);
+        }
+        return;
+    }
+    server.aof_current_size += len;
+    if (server.aof_child_pid != -1) {
+        server.aof_rewrite_buf =
+          sdscatlen(server.aof_rewrite_buf, s->aofbuf, len);
+    } else if (!server.aof_rewrite_scheduled && server.aof_rewrite_perc &&
+               server.aof_current_size > server.aof_rewrite_min_size &&
+               server.aof_current_size - server.aof_rewrite_base_size >
+                 server.aof_rewrite_base_size * server.aof_rewrite_perc /
+                   100) {
+        server.aof_rewrite_scheduled = 1;
+        rewrite = 1;
+    }
+    pthread_mutex_unlock(&server.aof_lock);
+    if (rewrite) {
+        redisLog(REDIS_NOTICE, "Starting automatic rewriting of AOF on "
+                               "%lld bytes",
+                 (long long)server.aof_current_size);
+        requestAppendOnlyRewrite();
+    }
+
+    if (sdsavail(s->aofbuf) + len > AOF_BUF_SHRINK) {
+        sdsfree(s->aofbuf);
+        s->aofbuf = sdsempty();
+    } else {
+        s->aofbuf = sdsrange(s->aofbuf, len, -1);
+    }
+
+    if (server.appendfsync == AOF_FSYNC_ALWAYS)
+        aof_fsync(__atomic_load_n(&server.aof_fd, __ATOMIC_ACQUIRE));
+    else if (server.appendfsync == AOF_FSYNC_PERIODIC)
+        __atomic_store_n(&server.aof_dirty, 1, __ATOMIC_RELEASE);
+}
+
+/* Sync the file every aof_fsync_period ms if anything was written in the
+ * meantime, so the event loops never wait for the disk. */
+static void*
+aofFsyncMain(void* arg)
+{
+    UNUSED(arg);
+
+    while (1) {
+        usleep(server.aof_fsync_period * 1000);
+        /* The fd changes when a rewrite completes. */
+        if (__atomic_exchange_n(&server.aof_dirty, 0, __ATOMIC_ACQ_REL))
+            aof_fsync(__atomic_load_n(&server.aof_fd, __ATOMIC_ACQUIRE));
+    }
+    return NULL;
+}
+
+/* Open the AOF for appending. Called once the old content was loaded. */
+void
+startAppendOnly(void)
+{
+    struct redis_stat sb;
+
+    server.aof_fd =
+      open(server.aof_filename, O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (server.aof_fd == -1 || redis_fstat(server.aof_fd, &sb) == -1) {
+        redisLog(REDIS_WARNING, "Can't open the append only file %s: %s",
+                 server.aof_filename, strerror(errno));
+        exit(1);
+    }
+    server.aof_current_size = sb.st_size;
+    server.aof_rewrite_base_size = sb.st_size;
+    if (server.appendfsync == AOF_FSYNC_PERIODIC &&
+        pthread_create(&server.aof_fsync_thread, NULL, aofFsyncMain, NULL) !=
+          0) {
+        redisLog(REDIS_WARNING, "Can't start the AOF fsync thread");
+        exit(1);
+    }
+}
+
+/* Ask the first shard to start a background rewrite. */
+void
+requestAppendOnlyRewrite(void)
+{
+    shardMessage m = { .type = SHARD_MSG_REWRITE };
+
+    postShardMessage(server.shards[0], &m);
+}
+
+static sds
+rewriteTempFileName(pid_t pid)
+{
+    return sdscatprintf(sdsempty(), "%s.rewrite-%d", server.aof_filename,
+                        (int)pid);
+}
+
+typedef struct rewriteState {
+    taskShard* shard;
+    childFile file;
+    sds buf;
+} rewriteState;
+
+static void
+rewriteTimeEvent(aeTimeEvent* te, void* privdata)
+{
+    rewriteState* rs = privdata;
+
+    /* Only tasks are logged. */
+    if (te->finalizerProc != freeTaskRecord) return;
+    rs->buf = catAppendOnlyTask(rs->buf, rs->shard, te->clientData);
+    childFileWrite(&rs->file, rs->buf, sdslen(rs->buf));
+    rs->buf = sdsrange(rs->buf, sdslen(rs->buf), -1);
+}
+
+/* Write every pending task of every shard to a temporary file. Runs in the
+ * child, which has a frozen copy of the shards. */
+static int
+rewriteAppendOnlyFile(void)
+{
+    sds tmpfile = rewriteTempFileName(getpid());
+    rewriteState rs;
+    int j;
+
+    if (childFileOpen(&rs.file, tmpfile) == REDIS_ERR) {
+        redisLog(REDIS_WARNING, "Opening the temp file for AOF rewrite: %s",
+                 strerror(errno));
+        return REDIS_ERR;
+    }
+    rs.buf = sdsempty();
+    for (j = 0; j < server.nshards; j++) {
+        rs.shard = server.shards[j];
+        aeForEachTimeEvent(rs.shard->el, rewriteTimeEvent, &rs);
+    }
+    if (childFileClose(&rs.file) == REDIS_ERR) {
+        redisLog(REDIS_WARNING, "Writing the AOF rewrite: %s",
+                 strerror(rs.file.err));
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static void*
+aofCloseMain(void* arg)
+{
+    close((int)(intptr_t)arg);
+    return NULL;
+}
+
+/* Close the replaced AOF in a thread: it is unlinked by now and releasing
+ * a big file can take a while. */
+static void
+closeOldAppendOnlyFile(int fd)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, aofCloseMain, (void*)(intptr_t)fd))
+        close(fd);
+    pthread_attr_destroy(&attr);
+}
+
+/* Append what was logged during the rewrite to the new file and put it in
+ * place of the old one. aof_lock is held, so no shard can log meanwhile. */
+static int
+installRewrittenAppendOnlyFile(char* tmpfile)
+{
+    size_t len = sdslen(server.aof_rewrite_buf);
+    struct redis_stat sb;
+    int newfd, oldfd;
+
+    newfd = open(tmpfile, O_WRONLY | O_APPEND);
+    if (newfd == -1) {
+        redisLog(REDIS_WARNING, "Opening the rewritten AOF: %s",
+                 strerror(errno));
+        return REDIS_ERR;
+    }
+    if (aofWrite(newfd, server.aof_rewrite_buf, len) != (ssize_t)len ||
+        (server.appendfsync != AOF_FSYNC_NO && aof_fsync(newfd) == -1) ||
+        redis_fstat(newfd, &sb) == -1 ||
+        rename(tmpfile, server.aof_filename) == -1) {
+        redisLog(REDIS_WARNING, "Installing the rewritten AOF: %s",
+                 strerror(errno));
+        close(newfd);
+        return REDIS_ERR;
+    }
+    oldfd = server.aof_fd;
+    __atomic_store_n(&server.aof_fd, newfd, __ATOMIC_RELEASE);
+    server.aof_current_size = sb.st_size;
+    server.aof_rewrite_base_size = sb.st_size;
+    closeOldAppendOnlyFile(oldfd);
+    return REDIS_OK;
+}
+
+static void
+backgroundRewriteStarted(pid_t pid)
+{
+    pthread_mutex_lock(&server.aof_lock);
+    server.aof_child_pid = pid;
+    server.aof_rewrite_buf = sdsempty();
+    /* Cleared together with the pid set, so BGREWRITEAOF always sees one
+     * of them. */
+    server.aof_rewrite_scheduled = 0;
+    pthread_mutex_unlock(&server.aof_lock);
+}
+
+static void
+backgroundRewriteDone(pid_t pid, int ok)
+{
+    sds tmpfile = rewriteTempFileName(pid);
+    int save;
+
+    pthread_mutex_lock(&server.aof_lock);
+    if (ok && installRewrittenAppendOnlyFile(tmpfile) == REDIS_OK) {
+        redisLog(REDIS_NOTICE,
+                 "Background AOF rewrite finished, %lld bytes (%zu logged "
+                 "during the rewrite)",
+                 (long long)server.aof_current_size,
+                 sdslen(server.aof_rewrite_buf));
+    } else {
+        unlink(tmpfile);
+    }
+    sdsfree(server.aof_rewrite_buf);
+    server.aof_rewrite_buf = NULL;
+    server.aof_child_pid = -1;
+    save = server.snapshot_scheduled;
+    pthread_mutex_unlock(&server.aof_lock);
+    sdsfree(tmpfile);
+    if (save) saveSnapshotBackground();
+}
+
+static backgroundChild rewriteChild = { "AOF rewrite", rewriteAppendOnlyFile,
+                                        backgroundRewriteStarted,
+                                        backgroundRewriteDone };
+
+static void
+setRewriteScheduled(int scheduled)
+{
+    pthread_mutex_lock(&server.aof_lock);
+    server.aof_rewrite_scheduled = scheduled;
+    pthread_mutex_unlock(&server.aof_lock);
+}
+
+/* Fork a child writing the pending tasks to a new AOF. With every shard
+ * paused and every AOF buffer written, the child gets the tasks exactly as
+ * the file describes them. Runs in the first shard. */
+int
+rewriteAppendOnlyFileBackground(void)
+{
+    /* Started again when the snapshot is saved. */
+    if (server.snapshot_child_pid != -1) return REDIS_ERR;
+    if (server.aof_fd == -1 || server.aof_child_pid != -1 ||
+        startBackgroundChild(&rewriteChild) == REDIS_ERR) {
+        setRewriteScheduled(0);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+void
+bgrewriteaofCommand(taskClient* c)
+{
+    static const char off[] = "-ERR append only file is off\r\n";
+    static const char busy[] =
+      "-ERR background append only file rewriting already in progress\r\n";
+    static const char ok[] =
+      "+Background append only file rewriting started\r\n";
+    int running;
+
+    if (server.aof_fd == -1) {
+        addReplyString(c, off, sizeof(off) - 1);
+        return;
+    }
+    pthread_mutex_lock(&server.aof_lock);
+    running = server.aof_child_pid != -1 || server.aof_rewrite_scheduled;
+    if (!running) server.aof_rewrite_scheduled = 1;
+    pthread_mutex_unlock(&server.aof_lock);
+    if (running) {
+        addReplyString(c, busy, sizeof(busy) - 1);
+        return;
+    }
+    requestAppendOnlyRewrite();
+    addReplyString(c, ok, sizeof(ok) - 1);
+}
+
+/* Reschedule a logged task in the shard owning its id. */
+static int
+loadTask(sds* argv)
+{
+    long long id, interval, deadline, when;
+    robj addr = { argv[5], REDIS_STRING, REDIS_ENCODING_RAW, 0, 0, 1 };
+    uint32_t endpoint;
+    taskRecord* task;
+    int type;
+
+    if (!string2ll(argv[1], sdslen(argv[1]), &id) || id < 0 ||
+        !string2ll(argv[3], sdslen(argv[3]), &interval) || interval < 0 ||
+        interval > INT_MAX || !string2ll(argv[4], sdslen(argv[4]), &deadline))
+        return REDIS_ERR;
+    if (!strcasecmp(argv[2], "once"))
+        type = TASK_ONCE;
+    else if (!strcasecmp(argv[2], "repeat"))
+        type = TASK_REPEAT;
+    else
+        return REDIS_ERR;
+
+    if (id % TASK_MAX_SHARDS >= server.nshards) {
+        redisLog(REDIS_WARNING,
+                 "The AOF has tasks of shard %lld, start the server with "
+                 "--shards %lld or more",
+                 id % TASK_MAX_SHARDS, id % TASK_MAX_SHARDS + 1);
+        exit(1);
+    }
+    myshard = server.shards[id % TASK_MAX_SHARDS];
+
+    if (internWorkerEndpoint(&addr, &endpoint) == REDIS_ERR)
+        return REDIS_ERR;
+
+    task = createTaskRecord(type, interval, endpoint, argv[6],
+                            sdslen(argv[6]));
+    when = aeWallToMonotonic(myshard->el, deadline);
+    if (aeRestoreTimeEvent(myshard->el, &task->te, id, when, notifyWorker,
+                           task, freeTaskRecord) == AE_ERR) {
+        zfree(task);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static int
+loadDel(sds* argv)
+{
+    long long id;
+
+    if (!string2ll(argv[1], sdslen(argv[1]), &id) || id < 0) return REDIS_ERR;
+    if (id % TASK_MAX_SHARDS < server.nshards) {
+        myshard = server.shards[id % TASK_MAX_SHARDS];
+        aeDeleteTimeEvent(myshard->el, id);
+    }
+    return REDIS_OK;
+}
+
+/* Rebuild the pending tasks from the AOF. Called at startup, before the
+ * shards run, so it can schedule tasks in any of them. A record cut short
+ * by a crash at the end of the file is dropped and the file truncated to
+ * the last complete one. Returns REDIS_ERR if there is no file. */
+int
+loadAppendOnlyFile(char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    char buf[128];
+    long long loaded = 0;
+    off_t valid = 0;
+    taskShard* saved = myshard;
+    struct redis_stat sb;
+
+    if (fp == NULL) {
+        if (errno == ENOENT) return REDIS_ERR;
+        redisLog(REDIS_WARNING, "Can't open the append only file %s: %s",
+                 filename, strerror(errno));
+        exit(1);
+    }
+    if (redis_fstat(fileno(fp), &sb) == -1) goto readerr;
+
+    while (1) {
+        sds argv[AOF_MAX_ARGS];
+        int argc, j, ok;
+
+        if (fgets(buf, sizeof(buf), fp) == NULL) {
+            if (feof(fp)) break;
+            goto readerr;
+        }
+        /* A header cut short by a crash is only missing its end. */
+        if (!strchr(buf, '\n') && feof(fp)) goto truncated;
+        if (buf[0] != '*') goto fmterr;
+        argc = atoi(buf + 1);
+        if (argc < 1 || argc > AOF_MAX_ARGS) goto fmterr;
+
+        for (j = 0; j < argc; j++) {
+            char* eptr;
+            long len;
+
+            if (fgets(buf, sizeof(buf), fp) == NULL) {
+                while (j--) sdsfree(argv[j]);
+                if (feof(fp)) goto truncated;
+                goto readerr;
+            }
+            if (!strchr(buf, '\n') && feof(fp)) {
+                while (j--) sdsfree(argv[j]);
+                goto truncated;
+            }
+            errno = 0;
+            len = strtol(buf + 1, &eptr, 10);
+            if (buf[0] != '$' || errno || eptr == buf + 1 || *eptr != '\r' ||
+                len < 0 || len > REDIS_REQUEST_MAX_SIZE) {
+                while (j--) sdsfree(argv[j]);
+                goto fmterr;
+            }
+            /* Don't allocate for bytes the file doesn't have. */
+            if (len + 2 > sb.st_size - ftello(fp)) {
+                while (j--) sdsfree(argv[j]);
+                goto truncated;
+            }
+            argv[j] = sdsnewlen(NULL, len);
+            if ((len && fread(argv[j], len, 1, fp) == 0) ||
+                fread(buf, 2, 1, fp) == 0) {
+                j++;
+                while (j--) sdsfree(argv[j]);
+                if (feof(fp)) goto truncated;
+                goto readerr;
+            }
+        }
+
+        if (argc == 7 && !strcasecmp(argv[0], "task"))
+            ok = loadTask(argv);
+        else if (argc == 2 && !strcasecmp(argv[0], "del"))
+            ok = loadDel(argv);
+        else
+            ok = REDIS_ERR;
+        for (j = 0; j < argc; j++)
+            sdsfree(argv[j]);
+        if (ok == REDIS_ERR) goto fmterr;
+        valid = ftello(fp);
+        loaded++;
+    }
+    fclose(fp);
+    myshard = saved;
+    redisLog(REDIS_NOTICE, "Loaded %lld records from the append only file",
+             loaded);
+    return REDIS_OK;
+
+truncated:
+    fclose(fp);
+    myshard = saved;
+    redisLog(REDIS_WARNING,
+             "The append only file ends with an incomplete record, "
+             "truncating it to %lld bytes",
+             (long long)valid);
+    if (truncate(filename, valid) == -1) {
+        redisLog(REDIS_WARNING, "Can't truncate the append only file: %s",
+                 strerror(errno));
+        exit(1);
+    }
+    return REDIS_OK;
+
+readerr:
+    redisLog(REDIS_WARNING, "Error reading the append only file: %s",
+             strerror(errno));
+    exit(1);
+
+fmterr:
+    redisLog(REDIS_WARNING,
+             "Bad record in the append only file at offset %lld",
+             (long long)valid);
+    exit(1);
+}
@@ -0,0 +1,142 @@
+/* Background children.
+ *
+ * An AOF rewrite and a snapshot both need a consistent copy of the tasks of
+ * every shard, and get it the same way: the first shard pauses the others,
+ * so that none is in the middle of a change and every AOF buffer is
+ * written, and forks. The child writes what it needs from its frozen copy
+ * of the shards to a temporary file and exits, while the shards go on.
+ *
+ * The child never writes to the pipe it inherits, the parent watches the
+ * other end and learns that the child exited when it reads EOF. This keeps
+ * SIGCHLD out of a process made of event loop threads. */
+
+#include "server.h"
+#include "config.h"
+
+#include <sys/wait.h>
+
+/* The child writes in chunks of this size. */
+#define CHILD_WRITE_CHUNK (1024 * 1024)
+
+typedef struct childWatch {
+    backgroundChild* bc;
+    pid_t pid;
+} childWatch;
+
+/* The child closed its end of the pipe, so it exited. */
+static void
+backgroundChildDoneHandler(aeEventLoop* el, int fd, void* privdata, int mask)
+{
+    UNUSED(mask);
+    childWatch* cw = privdata;
+    int statloc, ok = 0;
+
+    aeDeleteFileEvent(el, fd, AE_READABLE);
+    close(fd);
+    if (waitpid(cw->pid, &statloc, 0) == -1) {
+        redisLog(REDIS_WARNING, "Waiting for the background %s child: %s",
+                 cw->bc->name, strerror(errno));
+    } else if (!WIFEXITED(statloc) || WEXITSTATUS(statloc) != 0) {
+        redisLog(REDIS_WARNING, "Background %s failed", cw->bc->name);
+    } else {
+        ok = 1;
+    }
+    cw->bc->done(cw->pid, ok);
+    zfree(cw);
+}
+
+/* Fork a child running bc->run() with the shards paused, calling
+ * bc->started() before they resume and bc->done() in the current shard
+ * once the child exited. Runs in the first shard. */
+int
+startBackgroundChild(backgroundChild* bc)
+{
+    int pipefds[2];
+    pid_t childpid;
+    childWatch* cw;
+
+    if (pipe(pipefds) == -1) {
+        redisLog(REDIS_WARNING, "Can't start the background %s: pipe: %s",
+                 bc->name, strerror(errno));
+        return REDIS_ERR;
+    }
+
+    pauseShards();
+    flushAppendOnlyFile();
+    if ((childpid = fork()) == 0) {
+        close(pipefds[0]);
+        _exit(bc->run() == REDIS_OK ? 0 : 1);
+    }
+    if (childpid == -1) {
+        resumeShards();
+        close(pipefds[0]);
+        close(pipefds[1]);
+        redisLog(REDIS_WARNING, "Can't start the background %s: fork: %s",
+                 bc->name, strerror(errno));
+        return REDIS_ERR;
+    }
+    bc->started(childpid);
+    resumeShards();
+
+    close(pipefds[1]);
+    cw = zmalloc(sizeof(*cw));
+    cw->bc = bc;
+    cw->pid = childpid;
+    if (aeCreateFileEvent(myshard->el, pipefds[0], AE_READABLE,
+                          backgroundChildDoneHandler, cw) == AE_ERR) {
+        redisLog(REDIS_WARNING, "Can't watch the background %s child",
+                 bc->name);
+        exit(1);
+    }
+    redisLog(REDIS_NOTICE, "Background %s started by pid %d", bc->name,
+             (int)childpid);
+    return REDIS_OK;
+}
+
+/* Create 'filename' for writing. Returns REDIS_ERR with errno set if it
+ * can't be opened. */
+int
+childFileOpen(childFile* f, char* filename)
+{
+    f->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (f->fd == -1) return REDIS_ERR;
+    f->filename = filename;
+    f->buf = sdsempty();
+    f->err = 0;
+    return REDIS_OK;
+}
+
+static void
+childFileFlush(childFile* f)
+{
+    size_t len = sdslen(f->buf);
+
+    if (!f->err && aofWrite(f->fd, f->buf, len) != (ssize_t)len)
+        f->err = errno ? errno : EIO;
+    f->buf = sdsrange(f->buf, len, -1);
+}
+
+/* Append 'len' bytes to the file. Errors are remembered and reported by
+ * childFileClose(). */
+void
+childFileWrite(childFile* f, const void* p, size_t len)
+{
+    f->buf = sdscatlen(f->buf, (void*)p, len);
+    if (sdslen(f->buf) >= CHILD_WRITE_CHUNK) childFileFlush(f);
+}
+
+/* Write what is left, fsync and close the file. On error the file is
+ * removed and REDIS_ERR returned, with the cause in f->err. */
+int
+childFileClose(childFile* f)
+{
+    childFileFlush(f);
+    if (!f->err && aof_fsync(f->fd) == -1) f->err = errno;
+    close(f->fd);
+    sdsfree(f->buf);
+    if (f->err) {
+        unlink(f->filename);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
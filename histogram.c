@@ -0,0 +1,77 @@
+#include "histogram.h"
+
+#include <string.h>
+
+#define HIST_HALF (HIST_SUB_COUNT / 2)
+
+static int
+histogramIndex(uint64_t value)
+{
+    int shift;
+
+    if (value < HIST_SUB_COUNT) return (int)value;
+    if (value >> HIST_MAX_BITS) value = (1ULL << HIST_MAX_BITS) - 1;
+    /* Keep the HIST_SUB_BITS most significant bits: value >> shift is in
+     * [HIST_HALF, HIST_SUB_COUNT). */
+    shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return shift * HIST_HALF + (int)(value >> shift);
+}
+
+/* Highest value counted in bucket 'index'. */
+static uint64_t
+histogramBucketMax(int index)
+{
+    int shift;
+
+    if (index < HIST_SUB_COUNT) return index;
+    shift = index / HIST_HALF - 1;
+    return ((uint64_t)(index - shift * HIST_HALF + 1) << shift) - 1;
+}
+
+void
+histogramReset(histogram* h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void
+histogramRecord(histogram* h, uint64_t value)
+{
+    h->buckets[histogramIndex(value)]++;
+    h->count++;
+    if (value > h->max) h->max = value;
+}
+
+void
+histogramMerge(histogram* dst, const histogram* src)
+{
+    int j;
+
+    for (j = 0; j < HIST_BUCKETS; j++)
+        dst->buckets[j] += src->buckets[j];
+    dst->count += src->count;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+/* Value below which 'p' percent of the samples are, rounded up to the top
+ * of its bucket but never above the largest sample. 0 if empty. */
+uint64_t
+histogramPercentile(const histogram* h, double p)
+{
+    double exact = p / 100 * h->count;
+    uint64_t rank = (uint64_t)exact, seen = 0;
+    int j;
+
+    if (h->count == 0) return 0;
+    if (rank < exact || rank == 0) rank++;
+    if (rank > h->count) rank = h->count;
+    for (j = 0; j < HIST_BUCKETS; j++) {
+        seen += h->buckets[j];
+        if (seen >= rank) {
+            uint64_t v = histogramBucketMax(j);
+
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,35 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+/* Log-linear histogram of non negative integer samples, in the spirit of
+ * HdrHistogram.
+ *
+ * Values below HIST_SUB_COUNT have a bucket each. Above, every power of two
+ * is split into HIST_SUB_COUNT / 2 linear buckets, so a value is known with
+ * a relative error below 2 / HIST_SUB_COUNT (about 6%) whatever its
+ * magnitude. The buckets are inline: recording a sample is a shift, a count
+ * leading zeros and an increment, and never allocates. Values from
+ * 2^HIST_MAX_BITS on are counted in the last bucket, their exact maximum is
+ * still tracked. */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40 /* 2^40 us is about 12 days */
+#define HIST_BUCKETS \
+    ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * (HIST_SUB_COUNT / 2))
+
+typedef struct histogram
+{
+    uint64_t count;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+void histogramReset(histogram* h);
+void histogramRecord(histogram* h, uint64_t value);
+void histogramMerge(histogram* dst, const histogram* src);
+uint64_t histogramPercentile(const histogram* h, double p);
+
+#endif
@@ -0,0 +1,142 @@
+#include <stdint.h>
+
+#include "intmap.h"
+#include "zmalloc.h"
+
+/* Time event ids are allocated in steps of the shard count, so the low
+ * bits of the keys can't be used as they are: mix all of them. */
+static unsigned long
+intMapHash(long long key)
+{
+    uint64_t h = (uint64_t)key;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (unsigned long)h;
+}
+
+static intMapEntry*
+intMapAllocTable(unsigned long size)
+{
+    intMapEntry* table = zmalloc(sizeof(intMapEntry) * size);
+    unsigned long j;
+
+    for (j = 0; j < size; j++)
+        table[j].val = NULL;
+    return table;
+}
+
+intMap*
+intMapCreate(void)
+{
+    intMap* m = zmalloc(sizeof(*m));
+
+    m->size = INTMAP_INITIAL_SIZE;
+    m->used = 0;
+    m->table = intMapAllocTable(m->size);
+    return m;
+}
+
+void
+intMapRelease(intMap* m)
+{
+    zfree(m->table);
+    zfree(m);
+}
+
+/* Return the slot holding 'key', or the empty slot ending its probe
+ * sequence. */
+static unsigned long
+intMapSlot(intMap* m, long long key)
+{
+    unsigned long mask = m->size - 1, j = intMapHash(key) & mask;
+
+    while (m->table[j].val && m->table[j].key != key)
+        j = (j + 1) & mask;
+    return j;
+}
+
+static void
+intMapResize(intMap* m, unsigned long size)
+{
+    intMapEntry* old = m->table;
+    unsigned long oldsize = m->size, j;
+
+    m->table = intMapAllocTable(size);
+    m->size = size;
+    for (j = 0; j < oldsize; j++) {
+        if (old[j].val) m->table[intMapSlot(m, old[j].key)] = old[j];
+    }
+    zfree(old);
+}
+
+/* Add 'key' unless it is already there. Returns INTMAP_ERR if it was. */
+int
+intMapAdd(intMap* m, long long key, void* val)
+{
+    unsigned long j;
+
+    /* Keep the load factor under 3/4, probe sequences stay short. */
+    if ((m->used + 1) * 4 > m->size * 3) intMapResize(m, m->size * 2);
+    j = intMapSlot(m, key);
+    if (m->table[j].val) return INTMAP_ERR;
+    m->table[j].key = key;
+    m->table[j].val = val;
+    m->used++;
+    return INTMAP_OK;
+}
+
+/* Make room for 'count' keys at once, so adding them never resizes. */
+void
+intMapExpand(intMap* m, unsigned long count)
+{
+    unsigned long size = m->size;
+
+    while (count * 4 > size * 3)
+        size *= 2;
+    if (size != m->size) intMapResize(m, size);
+}
+
+/* Start loading the home slot of 'key' into the cache, ahead of an add or
+ * find that is a few keys away. */
+void
+intMapPrefetch(intMap* m, long long key)
+{
+    __builtin_prefetch(&m->table[intMapHash(key) & (m->size - 1)], 1);
+}
+
+void*
+intMapFind(intMap* m, long long key)
+{
+    return m->table[intMapSlot(m, key)].val;
+}
+
+/* Remove 'key' and return its value, or NULL if it is not there. */
+void*
+intMapDelete(intMap* m, long long key)
+{
+    unsigned long mask = m->size - 1, i = intMapSlot(m, key), j;
+    void* val = m->table[i].val;
+
+    if (val == NULL) return NULL;
+
+    /* Move back every following entry of the run that would no longer be
+     * reachable from its home slot once slot i is empty. */
+    for (j = (i + 1) & mask; m->table[j].val; j = (j + 1) & mask) {
+        unsigned long home = intMapHash(m->table[j].key) & mask;
+
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            m->table[i] = m->table[j];
+            i = j;
+        }
+    }
+    m->table[i].val = NULL;
+    m->used--;
+
+    if (m->size > INTMAP_INITIAL_SIZE && m->used * 8 < m->size)
+        intMapResize(m, m->size / 2);
+    return val;
+}
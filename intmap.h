@@ -0,0 +1,40 @@
+#ifndef __INTMAP_H__
+#define __INTMAP_H__
+
+/* Open addressing hash table from 64 bit integer keys to pointers.
+ *
+ * Entries live inline in a power of two table and collisions are resolved
+ * by linear probing, so a lookup is a hash and a short scan of adjacent
+ * slots, and adding a key allocates nothing unless the table has to grow.
+ * Deletion shifts the following entries back instead of leaving
+ * tombstones. Values can't be NULL, a NULL value marks an empty slot. */
+
+#define INTMAP_OK 0
+#define INTMAP_ERR 1
+
+#define INTMAP_INITIAL_SIZE 16
+
+typedef struct intMapEntry
+{
+    long long key;
+    void* val;
+} intMapEntry;
+
+typedef struct intMap
+{
+    intMapEntry* table;
+    unsigned long size; /* power of two */
+    unsigned long used;
+} intMap;
+
+#define intMapSize(m) ((m)->used)
+
+intMap* intMapCreate(void);
+void intMapRelease(intMap* m);
+int intMapAdd(intMap* m, long long key, void* val);
+void intMapExpand(intMap* m, unsigned long count);
+void intMapPrefetch(intMap* m, long long key);
+void* intMapFind(intMap* m, long long key);
+void* intMapDelete(intMap* m, long long key);
+
+#endif
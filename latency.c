@@ -0,0 +1,186 @@
+/* Latency histograms.
+ *
+ * Every event loop records how late each of its timers fires, the time
+ * between its deadline and the call of its callback (see recordFireLag in
+ * ae.c). This is what the scheduler promises its users, so LATENCY FIRING
+ * reports its percentiles merged over the shards.
+ *
+ * Every worker endpoint records how long its connects take, how long a
+ * message waits from its dispatch until the socket took all of it, and how
+ * many bytes were queued ahead of it (see worker.c). LATENCY ENDPOINTS
+ * merges the endpoints of the shards by address and lists them slowest
+ * write p99 first, so that a degraded worker stands out.
+ *
+ * The histograms are only written by the thread of their shard. They are
+ * merged from the thread of the client without locking, so a report may
+ * miss the samples recorded while it is built, and LATENCY RESET asks every
+ * shard to clear its own histograms instead of clearing them itself. */
+
+#include "server.h"
+
+typedef struct endpointLatency {
+    workerPool* pool; /* first of the shards, for the address */
+    histogram connect;
+    histogram write;
+    histogram queuedepth;
+    uint64_t p99; /* of write */
+} endpointLatency;
+
+static void
+addReplyHistogram(taskClient* c, histogram* h)
+{
+    addReplyBulkSds(c, sdscatprintf(sdsempty(),
+                                    "samples:%llu\r\n"
+                                    "p50_us:%llu\r\n"
+                                    "p99_us:%llu\r\n"
+                                    "p999_us:%llu\r\n"
+                                    "max_us:%llu\r\n",
+                                    (unsigned long long)h->count,
+                                    (unsigned long long)histogramPercentile(
+                                        h, 50),
+                                    (unsigned long long)histogramPercentile(
+                                        h, 99),
+                                    (unsigned long long)histogramPercentile(
+                                        h, 99.9),
+                                    (unsigned long long)h->max));
+}
+
+static sds
+catHistogram(sds s, const char* name, const char* unit, histogram* h)
+{
+    return sdscatprintf(s, ",%s=%llu,%s_p50_%s=%llu,%s_p99_%s=%llu,"
+                           "%s_max_%s=%llu",
+                        name, (unsigned long long)h->count, name, unit,
+                        (unsigned long long)histogramPercentile(h, 50), name,
+                        unit, (unsigned long long)histogramPercentile(h, 99),
+                        name, unit, (unsigned long long)h->max);
+}
+
+static int
+comparePoolAddress(const void* a, const void* b)
+{
+    const workerPool *pa = *(workerPool* const*)a,
+                     *pb = *(workerPool* const*)b;
+    int cmp = strcmp(pa->addr, pb->addr);
+
+    return cmp ? cmp : pa->port - pb->port;
+}
+
+static int
+compareEndpointP99(const void* a, const void* b)
+{
+    const endpointLatency *ea = *(endpointLatency* const*)a,
+                          *eb = *(endpointLatency* const*)b;
+
+    if (ea->p99 != eb->p99) return ea->p99 < eb->p99 ? 1 : -1;
+    return comparePoolAddress(&ea->pool, &eb->pool);
+}
+
+/* One line per endpoint, slowest write p99 first. Endpoints are never
+ * freed, so their pointers can be kept once taken under the lock. */
+static sds
+genEndpointsLatency(void)
+{
+    workerPool** pools = NULL;
+    endpointLatency** eps;
+    size_t npools = 0, neps = 0, j;
+    sds s = sdsempty();
+    int k;
+
+    for (k = 0; k < server.nshards; k++) {
+        taskShard* shard = server.shards[k];
+
+        pthread_mutex_lock(&shard->endpointslock);
+        pools = zrealloc(pools, sizeof(*pools) *
+                                  (npools + shard->nendpoints + 1));
+        memcpy(pools + npools, shard->endpoints,
+               sizeof(*pools) * shard->nendpoints);
+        npools += shard->nendpoints;
+        pthread_mutex_unlock(&shard->endpointslock);
+    }
+    qsort(pools, npools, sizeof(*pools), comparePoolAddress);
+
+    eps = zmalloc(sizeof(*eps) * (npools + 1));
+    for (j = 0; j < npools; j++) {
+        endpointLatency* e;
+
+        if (neps && !comparePoolAddress(&eps[neps - 1]->pool, &pools[j])) {
+            e = eps[neps - 1];
+        } else {
+            e = eps[neps++] = zmalloc(sizeof(*e));
+            e->pool = pools[j];
+            histogramReset(&e->connect);
+            histogramReset(&e->write);
+            histogramReset(&e->queuedepth);
+        }
+        histogramMerge(&e->connect, &pools[j]->stat_connect);
+        histogramMerge(&e->write, &pools[j]->stat_write);
+        histogramMerge(&e->queuedepth, &pools[j]->stat_queuedepth);
+    }
+    for (j = 0; j < neps; j++)
+        eps[j]->p99 = histogramPercentile(&eps[j]->write, 99);
+    qsort(eps, neps, sizeof(*eps), compareEndpointP99);
+
+    for (j = 0; j < neps; j++) {
+        endpointLatency* e = eps[j];
+
+        s = sdscatprintf(s, "endpoint=%s:%d", e->pool->addr, e->pool->port);
+        s = catHistogram(s, "writes", "us", &e->write);
+        s = catHistogram(s, "connects", "us", &e->connect);
+        s = catHistogram(s, "queued", "bytes", &e->queuedepth);
+        s = sdscat(s, "\r\n");
+        zfree(e);
+    }
+    zfree(eps);
+    zfree(pools);
+    return s;
+}
+
+/* Called in the shard thread on SHARD_MSG_LATENCY_RESET. */
+void
+resetLatencyHistograms(void)
+{
+    uint32_t j;
+
+    histogramReset(&myshard->el->stat_firelag);
+    for (j = 0; j < myshard->nendpoints; j++) {
+        workerPool* pool = myshard->endpoints[j];
+
+        histogramReset(&pool->stat_connect);
+        histogramReset(&pool->stat_write);
+        histogramReset(&pool->stat_queuedepth);
+    }
+}
+
+/* LATENCY FIRING
+ * LATENCY ENDPOINTS
+ * LATENCY RESET */
+void
+latencyCommand(taskClient* c)
+{
+    static const char syntaxerr[] = "-ERR syntax error\r\n";
+    char* sub = c->argv[1]->ptr;
+
+    if (c->argc != 2) {
+        addReplyString(c, syntaxerr, sizeof(syntaxerr) - 1);
+    } else if (!strcasecmp(sub, "firing")) {
+        histogram merged;
+        int j;
+
+        histogramReset(&merged);
+        for (j = 0; j < server.nshards; j++)
+            histogramMerge(&merged, &server.shards[j]->el->stat_firelag);
+        addReplyHistogram(c, &merged);
+    } else if (!strcasecmp(sub, "endpoints")) {
+        addReplyBulkSds(c, genEndpointsLatency());
+    } else if (!strcasecmp(sub, "reset")) {
+        shardMessage m = { .type = SHARD_MSG_LATENCY_RESET };
+        int j;
+
+        for (j = 0; j < server.nshards; j++)
+            postShardMessage(server.shards[j], &m);
+        addReply(c, shared.ok);
+    } else {
+        addReplyString(c, syntaxerr, sizeof(syntaxerr) - 1);
+    }
+}
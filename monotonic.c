@@ -0,0 +1,90 @@
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "monotonic.h"
+
+#undef USE_PROCESSOR_CLOCK_X86
+#if defined(USE_PROCESSOR_CLOCK) && defined(__x86_64__) && defined(__linux__)
+#define USE_PROCESSOR_CLOCK_X86
+#include <x86intrin.h>
+#endif
+
+static char monotonic_info[64];
+
+static monotime
+getMonotonicUs_posix(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((monotime)ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+monotime (*getMonotonicUs)(void) = getMonotonicUs_posix;
+
+#ifdef USE_PROCESSOR_CLOCK_X86
+static double mono_ticksPerMicrosecond = 0;
+
+static monotime
+getMonotonicUs_x86(void)
+{
+    return __rdtsc() / mono_ticksPerMicrosecond;
+}
+
+/* The TSC is only usable as a clock if it ticks at a constant rate and
+ * keeps ticking in deep C-states. */
+static int
+monotonicTscIsInvariant(void)
+{
+    FILE* cpuinfo = fopen("/proc/cpuinfo", "r");
+    char buf[4096];
+    int constant = 0, nonstop = 0;
+
+    if (!cpuinfo) return 0;
+    while (fgets(buf, sizeof(buf), cpuinfo) != NULL) {
+        if (strncmp(buf, "flags", 5) != 0) continue;
+        constant = strstr(buf, " constant_tsc") != NULL;
+        nonstop = strstr(buf, " nonstop_tsc") != NULL;
+        break;
+    }
+    fclose(cpuinfo);
+    return constant && nonstop;
+}
+
+/* Measure the TSC frequency against CLOCK_MONOTONIC over ~10ms. */
+static int
+monotonicInit_x86linux(void)
+{
+    monotime start_us, end_us;
+    unsigned long long start_tsc, end_tsc;
+
+    if (!monotonicTscIsInvariant()) return 0;
+    start_us = getMonotonicUs_posix();
+    start_tsc = __rdtsc();
+    while ((end_us = getMonotonicUs_posix()) - start_us < 10000)
+        ;
+    end_tsc = __rdtsc();
+    mono_ticksPerMicrosecond =
+      (double)(end_tsc - start_tsc) / (end_us - start_us);
+    return mono_ticksPerMicrosecond > 0;
+}
+#endif
+
+const char*
+monotonicInit(void)
+{
+    if (monotonic_info[0]) return monotonic_info;
+#ifdef USE_PROCESSOR_CLOCK_X86
+    if (monotonicInit_x86linux()) {
+        snprintf(monotonic_info, sizeof(monotonic_info),
+                 "X86 TSC @ %.0f ticks/us", mono_ticksPerMicrosecond);
+        getMonotonicUs = getMonotonicUs_x86;
+        return monotonic_info;
+    }
+#endif
+    snprintf(monotonic_info, sizeof(monotonic_info), "POSIX clock_gettime");
+    return monotonic_info;
+}
@@ -0,0 +1,20 @@
+#ifndef __MONOTONIC_H__
+#define __MONOTONIC_H__
+
+/* A monotonic clock for the event loop.
+ *
+ * By default it is CLOCK_MONOTONIC, which NTP can slew but never step. When
+ * built with -DUSE_PROCESSOR_CLOCK on x86_64 Linux and the CPU advertises an
+ * invariant TSC, the time stamp counter is read directly instead, skipping
+ * the vDSO call. */
+
+typedef unsigned long long monotime;
+
+/* Must be called once before getMonotonicUs(). Returns a description of
+ * the clock in use. */
+const char* monotonicInit(void);
+
+/* Microseconds since an arbitrary point in the past. */
+extern monotime (*getMonotonicUs)(void);
+
+#endif
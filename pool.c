@@ -0,0 +1,44 @@
+#include "pool.h"
+#include "zmalloc.h"
+
+void*
+poolAlloc(objPool* pool)
+{
+    void* ptr;
+
+    if (pool->freelist) {
+        ptr = pool->freelist;
+        pool->freelist = *(void**)ptr;
+    } else {
+        if (pool->next == NULL || pool->next + pool->size > pool->end) {
+            size_t count = POOL_SLAB_BYTES / pool->size;
+
+            if (count == 0) count = 1;
+            pool->next = zmalloc(count * pool->size);
+            pool->end = pool->next + count * pool->size;
+            pool->slabs++;
+        }
+        ptr = pool->next;
+        pool->next += pool->size;
+    }
+    pool->used++;
+    return ptr;
+}
+
+void
+poolFree(objPool* pool, void* ptr)
+{
+    if (ptr == NULL) return;
+    *(void**)ptr = pool->freelist;
+    pool->freelist = ptr;
+    pool->used--;
+}
+
+/* Bytes taken by the slabs of the pool. */
+size_t
+poolMemory(objPool* pool)
+{
+    size_t count = POOL_SLAB_BYTES / pool->size;
+
+    return pool->slabs * (count ? count : 1) * pool->size;
+}
@@ -0,0 +1,31 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+
+/* Fixed size object pool.
+ *
+ * Objects are carved out of POOL_SLAB_BYTES slabs and recycled through a
+ * free list, so they pay neither the zmalloc prefix nor the malloc chunk
+ * header. Slabs are never given back. A pool is not thread safe: pools are
+ * meant to be declared __thread, one per thread and object type. An object
+ * freed by another thread simply joins the free list of that thread, which
+ * is fine because slabs live as long as the process. */
+#define POOL_SLAB_BYTES (64 * 1024)
+#define POOL_ALIGN(sz) (((sz) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+#define POOL_STATIC_INIT(sz) { POOL_ALIGN(sz), NULL, NULL, NULL, 0, 0 }
+
+typedef struct objPool
+{
+    size_t size;    /* object size, aligned to a pointer */
+    void* freelist; /* freed objects, linked through their first word */
+    char* next;     /* next never used object of the current slab */
+    char* end;      /* end of the current slab */
+    long used;      /* objects handed out less objects freed here */
+    size_t slabs;
+} objPool;
+
+void* poolAlloc(objPool* pool);
+void poolFree(objPool* pool, void* ptr);
+size_t poolMemory(objPool* pool);
+#endif
@@ -105,7 +105,7 @@ void sdsupdatelen(sds s)
     sh->len = reallen;
 }
 
-static sds sdsMakeRoomFor(sds s, size_t addlen)
+sds sdsMakeRoomFor(sds s, size_t addlen)
 {
     struct sdshdr *sh, *newsh;
     size_t free = sdsavail(s);
@@ -129,6 +129,17 @@ static sds sdsMakeRoomFor(sds s, size_t addlen)
     return newsh->buf;
 }
 
+/* Account for 'incr' bytes written by the caller past the end of the
+ * string, in space obtained with sdsMakeRoomFor(). */
+void sdsIncrLen(sds s, int incr)
+{
+    struct sdshdr* sh = (void*)(s - (sizeof(struct sdshdr)));
+
+    sh->len += incr;
+    sh->free -= incr;
+    s[sh->len] = '\0';
+}
+
 sds sdscatlen(sds s, void* t, size_t len)
 {
     struct sdshdr* sh;
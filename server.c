@@ -1,14 +1,51 @@
 #include "server.h"
 
+#include <sys/uio.h>
+
 taskServer server;
+struct sharedObjectStruct shared;
+
+/* Small fixed size objects come from per thread pools. */
+static __thread objPool objectPool = POOL_STATIC_INIT(sizeof(robj));
 // prototype
 
+/* Arity is the exact number of arguments including the command name, or
+ * -N for at least N. */
 struct taskCommand cmdTable[] = {
-    { "get", getCommand, 2, REDIS_CMD_INLINE, NULL, 1, 1, 1 },
-    { "rpc", rpcCommand, 5, REDIS_CMD_BULK, NULL, 0, 0, 0 },
-    { "del", delCommand, 2, REDIS_CMD_INLINE, NULL, 1, 1, 1 }
+    { "get", getCommand, 2, REDIS_CMD_INLINE },
+    { "rpc", rpcCommand, 5, REDIS_CMD_BULK },
+    { "del", delCommand, 2, REDIS_CMD_INLINE },
+    { "quit", quitCommand, 1, REDIS_CMD_INLINE },
+    { "bgrewriteaof", bgrewriteaofCommand, 1, REDIS_CMD_INLINE },
+    { "bgsave", bgsaveCommand, 1, REDIS_CMD_INLINE },
+    { "info", infoCommand, -1, REDIS_CMD_INLINE },
+    { "latency", latencyCommand, -2, REDIS_CMD_INLINE },
+    { "slowlog", slowlogCommand, -2, REDIS_CMD_INLINE }
 };
 
+static void listenOn(taskShard* s, int fd);
+
+static unsigned int
+dictObjCaseHash(const void* key)
+{
+    robj* o = (robj*)key;
+    return dictGenCaseHashFunction(o->ptr, stringObjectLen(o));
+}
+
+static int
+dictObjKeyCaseCompare(void* privdata, const void* key1, const void* key2)
+{
+    UNUSED(privdata);
+    robj *o1 = (robj*)key1, *o2 = (robj*)key2;
+    size_t l1 = stringObjectLen(o1), l2 = stringObjectLen(o2);
+
+    return l1 == l2 && strncasecmp(o1->ptr, o2->ptr, l1) == 0;
+}
+
+/* Command names, looked up with the argv[0] view of the client. */
+dictType commandTableDictType = { dictObjCaseHash, NULL, NULL,
+                                  dictObjKeyCaseCompare, NULL, NULL };
+
 dictType dbDictType = { dictObjHash,
                         NULL,
                         NULL,
@@ -19,41 +56,193 @@ dictType dbDictType = { dictObjHash,
 void
 initServer()
 {
+    int j;
+
     server.mainthread = pthread_self();
-    server.el = aeCreateEventLoop(1024 * 10);
+    server.stat_starttime = time(NULL);
     server.port = 6379;
     server.bindaddr = "127.0.0.1";
     server.logfile = NULL;
-    server.stat_connections = 0;
     server.db = zmalloc(sizeof(taskDb));
     server.db->dict = dictCreate(&dbDictType, NULL);
-    server.timer_dict = dictCreate(&dbDictType, NULL);
-    server.fd = anetTcpServer(server.neterr, server.port, server.bindaddr);
-    server.clients = listCreate();
+    server.worker_max_conns = WORKER_DEFAULT_MAX_CONNS;
+    server.worker_idle_timeout = WORKER_DEFAULT_IDLE_TIMEOUT;
+    populateCommandTable();
+    slowlogInit();
+    server.shards = zmalloc(sizeof(taskShard*) * server.nshards);
+    for (j = 0; j < server.nshards; j++)
+        server.shards[j] = createShard(j);
+    server.nextshard = 0;
     createSharedObjects();
-    if (server.fd == -1) {
+    if (server.reuseport) {
+        /* Every shard listens on its own socket bound to the same port and
+         * the kernel spreads incoming connections among them. */
+        for (j = 0; j < server.nshards; j++) {
+            taskShard* s = server.shards[j];
+
+            s->fd = anetTcpReusePortServer(server.neterr, server.port,
+                                           server.bindaddr);
+            listenOn(s, s->fd);
+        }
+        server.fd = server.shards[0]->fd;
+    } else {
+        server.fd = anetTcpServer(server.neterr, server.port, server.bindaddr);
+        listenOn(server.shards[0], server.fd);
+    }
+}
+
+static void
+listenOn(taskShard* s, int fd)
+{
+    if (fd == -1) {
         redisLog(REDIS_WARNING, "task tcp open err:%s", server.neterr);
         exit(1);
     }
-    if (aeCreateFileEvent(server.el, server.fd, AE_READABLE, acceptHandler,
-                          NULL) == AE_ERR) {
-        redisLog(REDIS_WARNING, "ae read err:%s", server.fd);
+    if (aeCreateFileEvent(s->el, fd, AE_READABLE, acceptHandler, NULL) ==
+        AE_ERR) {
+        redisLog(REDIS_WARNING, "ae read err:%d", fd);
         exit(1);
     }
 }
 
+/* This function gets called every time the event loop of a shard is about
+ * to sleep. */
+void
+beforeSleep(struct aeEventLoop* eventLoop)
+{
+    time_t now = time(NULL);
+
+    /* Log the changes before telling anybody about them. */
+    flushAppendOnlyFile();
+    handleClientsWithPendingWrites();
+    flushWorkerConns();
+    if (now != myshard->lastcron) {
+        myshard->lastcron = now;
+        aeUpdateWallAnchor(eventLoop);
+        workerPoolCron();
+    }
+}
+
 int
 main(int argc, char** argv)
 {
-    if (argc > 1 && strcasecmp(argv[1], "--daemonize") == 0) daemonize();
+    int j;
+
+    server.timer_backend = AE_TIMER_SKIPLIST;
+    server.nshards = TASK_DEFAULT_SHARDS;
+    server.reuseport = 0;
+    server.appendonly = 0;
+    server.aof_filename = "appendonly.aof";
+    server.aof_fd = -1;
+    server.appendfsync = AOF_FSYNC_PERIODIC;
+    server.aof_fsync_period = 1000;
+    server.aof_dirty = 0;
+    server.aof_child_pid = -1;
+    server.aof_rewrite_buf = NULL;
+    server.aof_rewrite_perc = 100;
+    server.aof_rewrite_min_size = 64 * 1024 * 1024;
+    server.aof_rewrite_scheduled = 0;
+    server.snapshot_filename = "dump.snap";
+    server.snapshot_child_pid = -1;
+    server.snapshot_scheduled = 0;
+    server.snapshot_lastsave = 0;
+    server.slowlog_log_slower_than = 10000;
+    server.slowlog_max_len = 128;
+    pthread_mutex_init(&server.aof_lock, NULL);
+    for (j = 1; j < argc; j++) {
+        if (strcasecmp(argv[j], "--daemonize") == 0) {
+            daemonize();
+        } else if (strcasecmp(argv[j], "--timer-wheel") == 0) {
+            server.timer_backend = AE_TIMER_WHEEL;
+        } else if (strcasecmp(argv[j], "--reuseport") == 0) {
+            server.reuseport = 1;
+        } else if (strcasecmp(argv[j], "--appendonly") == 0) {
+            server.appendonly = 1;
+        } else if (strcasecmp(argv[j], "--appendfilename") == 0 &&
+                   j + 1 < argc) {
+            server.aof_filename = argv[++j];
+        } else if (strcasecmp(argv[j], "--appendfsync") == 0 && j + 1 < argc) {
+            char* policy = argv[++j];
+
+            if (strcasecmp(policy, "always") == 0) {
+                server.appendfsync = AOF_FSYNC_ALWAYS;
+            } else if (strcasecmp(policy, "no") == 0) {
+                server.appendfsync = AOF_FSYNC_NO;
+            } else if (strcasecmp(policy, "everysec") == 0) {
+                server.appendfsync = AOF_FSYNC_PERIODIC;
+                server.aof_fsync_period = 1000;
+            } else if ((server.aof_fsync_period = atoi(policy)) > 0) {
+                server.appendfsync = AOF_FSYNC_PERIODIC;
+            } else {
+                fprintf(stderr, "--appendfsync must be always, everysec, no "
+                                "or a period in milliseconds\n");
+                exit(1);
+            }
+        } else if (j + 1 < argc &&
+                   strcasecmp(argv[j], "--auto-aof-rewrite-percentage") == 0) {
+            server.aof_rewrite_perc = atoi(argv[++j]);
+        } else if (strcasecmp(argv[j], "--auto-aof-rewrite-min-size") == 0 &&
+                   j + 1 < argc) {
+            server.aof_rewrite_min_size = memtoll(argv[++j], NULL);
+        } else if (strcasecmp(argv[j], "--dbfilename") == 0 && j + 1 < argc) {
+            server.snapshot_filename = argv[++j];
+        } else if (strcasecmp(argv[j], "--slowlog-log-slower-than") == 0 &&
+                   j + 1 < argc) {
+            server.slowlog_log_slower_than = atoll(argv[++j]);
+        } else if (strcasecmp(argv[j], "--slowlog-max-len") == 0 &&
+                   j + 1 < argc) {
+            server.slowlog_max_len = atoi(argv[++j]);
+            if (server.slowlog_max_len < 1) {
+                fprintf(stderr, "--slowlog-max-len must be positive\n");
+                exit(1);
+            }
+        } else if (strcasecmp(argv[j], "--shards") == 0 && j + 1 < argc) {
+            server.nshards = atoi(argv[++j]);
+            if (server.nshards < 1 || server.nshards > TASK_MAX_SHARDS) {
+                fprintf(stderr, "--shards must be between 1 and %d\n",
+                        TASK_MAX_SHARDS);
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[j]);
+            exit(1);
+        }
+    }
+    if (server.nshards > 1) zmalloc_enable_thread_safeness();
     initServer();
+    /* The AOF has every change, the snapshot only the last save. */
+    if (server.appendonly) {
+        loadAppendOnlyFile(server.aof_filename);
+        startAppendOnly();
+    } else {
+        loadSnapshot(server.snapshot_filename);
+    }
+    startShards();
     redisLog(REDIS_NOTICE,
-             "The server is now ready to accept connections on port %d",
-             server.port);
-    aeMain(server.el);
+             "The server is now ready to accept connections on port %d "
+             "with %d shards",
+             server.port, server.nshards);
+    aeMain(myshard->el);
     return 0;
 }
 
+/* Return the UNIX time in microseconds */
+long long
+ustime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((long long)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/* Return the UNIX time in milliseconds */
+long long
+mstime(void)
+{
+    return ustime() / 1000;
+}
+
 void
 daemonize(void)
 {
@@ -75,10 +264,15 @@ readQueryFromClient(aeEventLoop* el, int fd, void* privdata, int mask)
     UNUSED(el);
     UNUSED(mask);
     taskClient* c = (taskClient*)privdata;
-    char buf[REDIS_IOBUF_LEN];
+    size_t readlen = c->readlen, buffered = sdslen(c->querybuf) - c->qbpos;
     int nread;
 
-    nread = read(fd, buf, REDIS_IOBUF_LEN);
+    /* The rest of a big bulk argument is read in one go. */
+    if (c->bulklen != -1 && buffered < (size_t)c->bulklen + 2 &&
+        c->bulklen + 2 - buffered > readlen)
+        readlen = c->bulklen + 2 - buffered;
+    c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
+    nread = read(fd, c->querybuf + sdslen(c->querybuf), readlen);
     if (nread == -1) {
         if (errno == EAGAIN) {
             nread = 0;
@@ -92,65 +286,192 @@ readQueryFromClient(aeEventLoop* el, int fd, void* privdata, int mask)
         freeClient(c);
         return;
     }
-    if (nread) {
-        c->querybuf = sdscatlen(c->querybuf, buf, nread);
+    if (nread && !(c->flags & REDIS_CLOSE_AFTER_REPLY)) {
+        sdsIncrLen(c->querybuf, nread);
     } else {
         return;
     }
+
+    /* Read more next time if this read filled the buffer, less if the
+     * client only sends a little at a time. */
+    if (readlen == c->readlen) {
+        if ((size_t)nread == readlen && c->readlen < REDIS_IOBUF_MAX_LEN)
+            c->readlen *= 2;
+        else if ((size_t)nread < readlen / 4 && c->readlen > REDIS_IOBUF_LEN)
+            c->readlen /= 2;
+    }
     processInputBuffer(c);
 }
 
-void
-processInputBuffer(taskClient* c)
+/* Reply with a protocol error and close the client once it was sent. */
+static void
+setProtocolError(taskClient* c, char* msg)
+{
+    redisLog(REDIS_VERBOSE, "Protocol error from client: %s", msg);
+    addReplySds(c, sdscatprintf(sdsempty(), "-ERR Protocol error: %s\r\n", msg));
+    c->flags |= REDIS_CLOSE_AFTER_REPLY;
+}
+
+/* Parse a "<prefix><number>\r\n" line at c->qbpos. Returns 1 and moves
+ * qbpos past the line when it is complete, 0 if more data is needed and -1
+ * if the line is malformed. */
+static int
+parseHeaderLine(taskClient* c, char prefix, long long* value)
+{
+    char* p = c->querybuf + c->qbpos;
+    size_t avail = sdslen(c->querybuf) - c->qbpos;
+    char* newline = memchr(p, '\r', avail);
+
+    if (newline == NULL || newline + 1 == p + avail)
+        return avail > REDIS_MAX_HEADER_LEN ? -1 : 0;
+    if (p[0] != prefix || newline[1] != '\n' ||
+        !string2ll(p + 1, newline - (p + 1), value))
+        return -1;
+    c->qbpos += newline - p + 2;
+    return 1;
+}
+
+/* Make room for 'cap' arguments. argv points into argvarena, so the
+ * pointers of the arguments already parsed are moved with it. */
+static void
+resizeClientArgv(taskClient* c, int cap)
+{
+    int j;
+
+    c->argvcap = cap;
+    c->argv = zrealloc(c->argv, sizeof(robj*) * cap);
+    c->argvarena = zrealloc(c->argvarena, sizeof(argView) * cap);
+    for (j = 0; j < c->argc; j++)
+        c->argv[j] = &c->argvarena[j].o;
+}
+
+/* Parse as much of the multibulk request at c->qbpos as the query buffer
+ * holds. The state is kept in the client, so the next call resumes where
+ * this one stopped. Arguments are not copied: each one is an argView into
+ * querybuf, with the '\r' after it overwritten by a NUL. Returns REDIS_OK
+ * when c->argv holds a complete command, with argc 0 for an empty one. */
+static int
+processMultibulkBuffer(taskClient* c)
 {
-    char* newline = NULL;
-    int pos = 0, ok;
     long long ll;
+    int ret, j;
 
     if (c->multibulklen == 0) {
-        newline = strchr(c->querybuf, '\r');
-        ok = string2ll(c->querybuf + 1, newline - (c->querybuf + 1), &ll);
-        pos = (newline - c->querybuf) + 2;
+        if ((ret = parseHeaderLine(c, '*', &ll)) <= 0) {
+            if (ret == -1) setProtocolError(c, "invalid multibulk length");
+            return REDIS_ERR;
+        }
+        if (ll > REDIS_MAX_MULTIBULK_LEN) {
+            setProtocolError(c, "invalid multibulk length");
+            return REDIS_ERR;
+        }
+        /* "*0" and "*-1" are empty requests, skipped by the caller. */
+        if (ll <= 0) {
+            c->argc = 0;
+            return REDIS_OK;
+        }
+        /* The header alone is not trusted for more than
+         * REDIS_MULTIBULK_PREALLOC slots, the rest is allocated as the
+         * arguments actually arrive. */
+        c->argc = 0;
+        if (c->argvcap < ll && c->argvcap < REDIS_MULTIBULK_PREALLOC)
+            resizeClientArgv(c, ll < REDIS_MULTIBULK_PREALLOC
+                                    ? ll : REDIS_MULTIBULK_PREALLOC);
         c->multibulklen = ll;
-
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*) * c->multibulklen);
     }
 
     while (c->multibulklen) {
+        argView* v;
+
+        if (c->argc == c->argvcap) {
+            long long cap = (long long)c->argvcap * 2;
+
+            if (cap > c->argc + c->multibulklen)
+                cap = c->argc + c->multibulklen;
+            resizeClientArgv(c, cap);
+        }
+
         if (c->bulklen == -1) {
-            newline = strchr(c->querybuf + pos, '\r');
-            if (newline - (c->querybuf) > ((signed)sdslen(c->querybuf) - 2))
-                break;
-            ok = string2ll(c->querybuf + pos + 1,
-                           newline - (c->querybuf + pos + 1), &ll);
-            pos += newline - (c->querybuf + pos) + 2;
+            if ((ret = parseHeaderLine(c, '$', &ll)) <= 0) {
+                if (ret == -1) setProtocolError(c, "expected '$'");
+                return REDIS_ERR;
+            }
+            if (ll < 0 || ll > REDIS_REQUEST_MAX_SIZE) {
+                setProtocolError(c, "invalid bulk length");
+                return REDIS_ERR;
+            }
             c->bulklen = ll;
         }
-        if (sdslen(c->querybuf) - pos < (unsigned)(c->bulklen + 2)) {
-            break;
-        } else {
-            c->argv[c->argc++] = createObject(
-              OBJ_STRING, sdsnewlen(c->querybuf + pos, c->bulklen));
-            pos += c->bulklen + 2;
-            c->bulklen = -1;
-            c->multibulklen--;
+        if (sdslen(c->querybuf) - c->qbpos < (size_t)c->bulklen + 2)
+            return REDIS_ERR;
+        if (c->querybuf[c->qbpos + c->bulklen] != '\r' ||
+            c->querybuf[c->qbpos + c->bulklen + 1] != '\n') {
+            setProtocolError(c, "bulk not terminated by CRLF");
+            return REDIS_ERR;
         }
+
+        v = &c->argvarena[c->argc];
+        v->o.type = REDIS_STRING;
+        v->o.encoding = REDIS_ENCODING_VIEW;
+        v->o.refcount = 1;
+        v->len = c->bulklen;
+        v->off = c->qbpos;
+        c->querybuf[c->qbpos + c->bulklen] = '\0';
+        c->argv[c->argc++] = &v->o;
+        c->qbpos += c->bulklen + 2;
+        c->bulklen = -1;
+        c->multibulklen--;
+    }
+
+    /* querybuf does not move until the command ran and the client was
+     * reset, so the views can be resolved now. */
+    for (j = 0; j < c->argc; j++)
+        c->argvarena[j].o.ptr = c->querybuf + c->argvarena[j].off;
+    return REDIS_OK;
+}
+
+/* Drop the bytes that were parsed from the query buffer. The arguments of
+ * a command that is not complete yet are kept and their offsets moved. */
+static void
+trimQueryBuffer(taskClient* c)
+{
+    size_t keep = c->argc ? c->argvarena[0].off : c->qbpos;
+    int j;
+
+    if (keep == 0) return;
+    sdsrange(c->querybuf, keep, -1);
+    c->qbpos -= keep;
+    for (j = 0; j < c->argc; j++)
+        c->argvarena[j].off -= keep;
+
+    /* Don't keep the room taken by a big argument around. */
+    if (sdslen(c->querybuf) == 0 &&
+        sdsavail(c->querybuf) > REDIS_IOBUF_MAX_LEN) {
+        sdsfree(c->querybuf);
+        c->querybuf = sdsempty();
     }
-    /* Trim to pos */
-    if (pos) sdsrange(c->querybuf, pos, -1);
-    processCommand(c);
+}
+
+/* Run every complete command in the query buffer, so that a pipeline
+ * received in one read is served in one go. */
+void
+processInputBuffer(taskClient* c)
+{
+    while (c->qbpos < sdslen(c->querybuf) &&
+           !(c->flags & (REDIS_BLOCKED | REDIS_CLOSE_AFTER_REPLY))) {
+        if (processMultibulkBuffer(c) != REDIS_OK) break;
+        if (c->argc == 0)
+            resetClient(c);
+        else
+            processCommand(c);
+    }
+    trimQueryBuffer(c);
 }
 
 int
 processCommand(taskClient* c)
 {
-    struct taskCommand* cmd;
-    if (!strcasecmp(c->argv[0]->ptr, "quit")) {
-        freeClient(c);
-        return 0;
-    }
-    cmd = lookupCommand(c->argv[0]->ptr);
+    struct taskCommand* cmd = lookupCommand(c->argv[0]);
 
     if (!cmd) {
         addReplySds(c, sdscatprintf(sdsempty(), "-ERR unknown command '%s'\r\n",
@@ -158,31 +479,75 @@ processCommand(taskClient* c)
         resetClient(c);
         return 1;
     }
+    if ((cmd->arity > 0 && cmd->arity != c->argc) || (c->argc < -cmd->arity)) {
+        addReplySds(c, sdscatprintf(sdsempty(),
+                                    "-ERR wrong number of arguments for '%s' "
+                                    "command\r\n",
+                                    cmd->name));
+        resetClient(c);
+        return 1;
+    }
     call(c, cmd);
     resetClient(c);
     return 1;
 }
 
-struct taskCommand*
-lookupCommand(char* cmd)
+/* Fill server.commands from cmdTable. Any pending rehash is completed here
+ * so that lookups from every shard only read the dict. */
+void
+populateCommandTable(void)
 {
-    for (int i = 0; i < REDIS_CMD_NUM; i++) {
-        if (!strcasecmp(cmdTable[i].name, cmd)) return &cmdTable[i];
+    int numcommands = sizeof(cmdTable) / sizeof(struct taskCommand), j;
+
+    server.commands = dictCreate(&commandTableDictType, NULL);
+    dictExpand(server.commands, numcommands);
+    for (j = 0; j < numcommands; j++) {
+        struct taskCommand* cmd = cmdTable + j;
+        robj* name = createObject(REDIS_STRING, sdsnew(cmd->name));
+
+        dictAdd(server.commands, name, cmd);
     }
-    return NULL;
+    while (dictRehash(server.commands, 100))
+        ;
+}
+
+struct taskCommand*
+lookupCommand(robj* name)
+{
+    dictEntry* de = dictFind(server.commands, name);
+    return de ? dictGetEntryVal(de) : NULL;
 }
 void
 call(taskClient* c, struct taskCommand* cmd)
 {
-    cmd->proc(c);
+    monotime start;
+
+    if (server.slowlog_log_slower_than < 0) {
+        cmd->proc(c);
+    } else {
+        c->cmdtimeid = -1;
+        start = getMonotonicUs();
+        cmd->proc(c);
+        slowlogPushEntryIfNeeded(c->argv, c->argc, c->cmdtimeid,
+                                 (long long)(getMonotonicUs() - start));
+    }
+    myshard->stat_numcommands++;
 }
 
 void
 freeClient(taskClient* c)
 {
+    /* A client waiting for another shard is only unlinked, it is freed when
+     * the answer comes back. */
+    if (c->flags & REDIS_BLOCKED) {
+        unlinkClient(c);
+        return;
+    }
     unlinkClient(c);
     listRelease(c->reply);
-    close(c->fd);
+    sdsfree(c->querybuf);
+    zfree(c->argv);
+    zfree(c->argvarena);
     zfree(c);
 }
 
@@ -192,17 +557,28 @@ unlinkClient(taskClient* c)
     listNode* ln;
     if (c->fd != -1) {
         /* Remove from the list of active clients. */
-        ln = listSearchKey(server.clients, c);
-        listDelNode(server.clients, ln);
+        ln = listSearchKey(c->shard->clients, c);
+        listDelNode(c->shard->clients, ln);
+        if (c->flags & REDIS_PENDING_WRITE) {
+            ln = listSearchKey(c->shard->clients_pending_write, c);
+            listDelNode(c->shard->clients_pending_write, ln);
+            c->flags &= ~REDIS_PENDING_WRITE;
+        }
 
         /* Unregister async I/O handlers and close the socket. */
-        aeDeleteFileEvent(server.el, c->fd, AE_READABLE);
-        aeDeleteFileEvent(server.el, c->fd, AE_WRITABLE);
+        aeDeleteFileEvent(c->shard->el, c->fd, AE_READABLE);
+        aeDeleteFileEvent(c->shard->el, c->fd, AE_WRITABLE);
         close(c->fd);
         c->fd = -1;
     }
 }
 
+static void
+freeReplyChunk(void* chunk)
+{
+    sdsfree(chunk);
+}
+
 taskClient*
 createClient(int fd)
 {
@@ -212,27 +588,43 @@ createClient(int fd)
     anetTcpNoDelay(NULL, fd);
     if (!c) return NULL;
 
-    if (aeCreateFileEvent(server.el, fd, AE_READABLE, readQueryFromClient, c) ==
-        AE_ERR) {
+    if (aeCreateFileEvent(myshard->el, fd, AE_READABLE, readQueryFromClient,
+                          c) == AE_ERR) {
         close(fd);
         zfree(c);
         return NULL;
     }
 
     c->fd = fd;
+    c->flags = 0;
+    c->shard = myshard;
     c->querybuf = sdsempty();
+    c->qbpos = 0;
+    c->readlen = REDIS_IOBUF_LEN;
     c->argc = 0;
     c->argv = NULL;
+    c->argvarena = NULL;
+    c->argvcap = 0;
     c->sentlen = 0;
     c->multibulklen = 0;
     c->bulklen = -1;
     c->db = server.db;
+    c->cmdtimeid = -1;
+    c->bufpos = 0;
     c->reply = listCreate();
-    listSetFreeMethod(c->reply, decrRefCount);
-    listAddNodeTail(server.clients, c);
+    listSetFreeMethod(c->reply, freeReplyChunk);
+    listAddNodeTail(myshard->clients, c);
     return c;
 }
 
+/* Called in the client shard once the shard it was waiting for answered. */
+void
+unblockClient(taskClient* c)
+{
+    c->flags &= ~REDIS_BLOCKED;
+    if (sdslen(c->querybuf)) processInputBuffer(c);
+}
+
 void
 acceptHandler(aeEventLoop* el, int fd, void* privdata, int mask)
 {
@@ -242,6 +634,7 @@ acceptHandler(aeEventLoop* el, int fd, void* privdata, int mask)
     int cport, cfd;
     char cip[128];
     taskClient* c;
+    taskShard* target;
 
     cfd = anetAccept(server.neterr, fd, cip, &cport);
     if (cfd == AE_ERR) {
@@ -250,13 +643,24 @@ acceptHandler(aeEventLoop* el, int fd, void* privdata, int mask)
         return;
     }
     redisLog(REDIS_VERBOSE, "Accepted %s:%d %d", cip, cport, cfd);
+    myshard->stat_connections++;
+
+    /* With a single listening socket the connections are spread over the
+     * shards round robin, otherwise the kernel already picked this shard. */
+    if (!server.reuseport) {
+        target = server.shards[server.nextshard];
+        server.nextshard = (server.nextshard + 1) % server.nshards;
+        if (target != myshard) {
+            shardMessage m = { .type = SHARD_MSG_CLIENT, .fd = cfd };
+            postShardMessage(target, &m);
+            return;
+        }
+    }
     if ((c = createClient(cfd)) == NULL) {
         redisLog(REDIS_WARNING, "Error allocating client: %s", strerror(errno));
         close(cfd);
         return;
     }
-
-    server.stat_connections++;
 }
 
 void
@@ -272,10 +676,11 @@ redisLog(int level, const char* fmt, ...)
     char* c = ".-*#";
     char buf[64];
     time_t now;
+    struct tm tm;
 
     now = time(NULL);
 
-    strftime(buf, 64, "%d %b %H:%M:%S", localtime(&now));
+    strftime(buf, 64, "%d %b %H:%M:%S", localtime_r(&now, &tm));
     fprintf(fp, "[%d] %s %c ", (int)getpid(), buf, c[level]);
     vfprintf(fp, fmt, ap);
     fprintf(fp, "\n");
@@ -286,11 +691,18 @@ redisLog(int level, const char* fmt, ...)
     if (server.logfile) fclose(fp);
 }
 
+size_t
+stringObjectLen(robj* o)
+{
+    if (o->encoding == REDIS_ENCODING_VIEW) return ((argView*)o)->len;
+    return sdslen(o->ptr);
+}
+
 robj*
 createObject(int type, void* ptr)
 {
     robj* o;
-    o = zmalloc(sizeof(*o));
+    o = poolAlloc(&objectPool);
     o->type = type;
     o->encoding = REDIS_ENCODING_RAW;
     o->ptr = ptr;
@@ -298,6 +710,223 @@ createObject(int type, void* ptr)
     return o;
 }
 
+/* Convert an amount of bytes into a human readable string like 1.50M. */
+static void
+bytesToHuman(char* s, size_t len, unsigned long long n)
+{
+    if (n < 1024)
+        snprintf(s, len, "%lluB", n);
+    else if (n < 1024 * 1024)
+        snprintf(s, len, "%.2fK", n / 1024.0);
+    else if (n < 1024ULL * 1024 * 1024)
+        snprintf(s, len, "%.2fM", n / (1024.0 * 1024));
+    else
+        snprintf(s, len, "%.2fG", n / (1024.0 * 1024 * 1024));
+}
+
+static int
+infoSection(const char* wanted, const char* name, int* sections)
+{
+    if (wanted && strcasecmp(wanted, name)) return 0;
+    (*sections)++;
+    return 1;
+}
+
+/* Build the INFO reply, only 'section' if not NULL. Counters of other
+ * shards are read without synchronization while their threads update
+ * them, the totals are a close approximation and not a snapshot. */
+static sds
+genInfoString(const char* section)
+{
+    sds info = sdsempty();
+    long long clients = 0, connections = 0, commands = 0, fired = 0;
+    long long cancelled = 0, dispatchfail = 0, workererr = 0;
+    long long iterations = 0, busy = 0, poll = 0, maxbusy = 0;
+    unsigned long pending = 0, idsize = 0, idused = 0;
+    int sections = 0, level = 0, aofrewriting, saving, j;
+    off_t aofsize, aofbase;
+    time_t lastsave;
+    char hmem[64];
+    dict* d = server.db->dict;
+
+    if (section && (!strcasecmp(section, "all") ||
+                    !strcasecmp(section, "default")))
+        section = NULL;
+
+    for (j = 0; j < server.nshards; j++) {
+        taskShard* s = server.shards[j];
+        aeEventLoop* el = s->el;
+        intMap* ids;
+
+        clients += listLength(s->clients);
+        connections += s->stat_connections;
+        commands += s->stat_numcommands;
+        fired += s->stat_fired;
+        cancelled += s->stat_cancelled;
+        dispatchfail += s->stat_dispatch_failed;
+        workererr += s->stat_worker_errors;
+        iterations += el->stat_iterations;
+        busy += el->stat_busy_us;
+        poll += el->stat_poll_us;
+        if (el->stat_max_busy_us > maxbusy) maxbusy = el->stat_max_busy_us;
+        pending += aePendingTimeEvents(el);
+        if (el->timerBackend == AE_TIMER_WHEEL) {
+            ids = el->timeEventWheel->ids;
+        } else {
+            ids = el->timeEventSkiplist->ids;
+            if (el->timeEventSkiplist->level > level)
+                level = el->timeEventSkiplist->level;
+        }
+        idsize += ids->size;
+        idused += ids->used;
+    }
+
+    if (infoSection(section, "server", &sections)) {
+        time_t uptime = time(NULL) - server.stat_starttime;
+
+        info = sdscatprintf(info,
+                            "# Server\r\n"
+                            "multiplexing_api:%s\r\n"
+                            "process_id:%ld\r\n"
+                            "tcp_port:%d\r\n"
+                            "uptime_in_seconds:%ld\r\n"
+                            "uptime_in_days:%ld\r\n"
+                            "shards:%d\r\n"
+                            "timer_backend:%s\r\n",
+                            aeGetApiName(), (long)getpid(), server.port,
+                            (long)uptime, (long)(uptime / (3600 * 24)),
+                            server.nshards,
+                            server.timer_backend == AE_TIMER_WHEEL ?
+                                "wheel" : "skiplist");
+    }
+    if (infoSection(section, "clients", &sections)) {
+        if (sections > 1) info = sdscat(info, "\r\n");
+        info = sdscatprintf(info,
+                            "# Clients\r\n"
+                            "connected_clients:%lld\r\n",
+                            clients);
+    }
+    if (infoSection(section, "memory", &sections)) {
+        size_t used = zmalloc_used_memory();
+
+        if (sections > 1) info = sdscat(info, "\r\n");
+        bytesToHuman(hmem, sizeof(hmem), used);
+        info = sdscatprintf(info,
+                            "# Memory\r\n"
+                            "used_memory:%zu\r\n"
+                            "used_memory_human:%s\r\n",
+                            used, hmem);
+    }
+    if (infoSection(section, "persistence", &sections)) {
+        if (sections > 1) info = sdscat(info, "\r\n");
+        pthread_mutex_lock(&server.aof_lock);
+        aofrewriting = server.aof_child_pid != -1;
+        saving = server.snapshot_child_pid != -1;
+        aofsize = server.aof_current_size;
+        aofbase = server.aof_rewrite_base_size;
+        lastsave = server.snapshot_lastsave;
+        pthread_mutex_unlock(&server.aof_lock);
+        info = sdscatprintf(info,
+                            "# Persistence\r\n"
+                            "bgsave_in_progress:%d\r\n"
+                            "last_save_time:%ld\r\n"
+                            "aof_enabled:%d\r\n"
+                            "aof_rewrite_in_progress:%d\r\n",
+                            saving, (long)lastsave, server.appendonly,
+                            aofrewriting);
+        if (server.appendonly)
+            info = sdscatprintf(info,
+                                "aof_current_size:%lld\r\n"
+                                "aof_base_size:%lld\r\n",
+                                (long long)aofsize, (long long)aofbase);
+    }
+    if (infoSection(section, "stats", &sections)) {
+        if (sections > 1) info = sdscat(info, "\r\n");
+        info = sdscatprintf(info,
+                            "# Stats\r\n"
+                            "total_connections_received:%lld\r\n"
+                            "total_commands_processed:%lld\r\n"
+                            "total_tasks_fired:%lld\r\n"
+                            "total_tasks_cancelled:%lld\r\n"
+                            "total_dispatch_failures:%lld\r\n"
+                            "total_worker_errors:%lld\r\n",
+                            connections, commands, fired, cancelled,
+                            dispatchfail, workererr);
+    }
+    if (infoSection(section, "eventloop", &sections)) {
+        if (sections > 1) info = sdscat(info, "\r\n");
+        info = sdscatprintf(info,
+                            "# Eventloop\r\n"
+                            "eventloop_iterations:%lld\r\n"
+                            "eventloop_busy_us:%lld\r\n"
+                            "eventloop_poll_us:%lld\r\n"
+                            "eventloop_avg_busy_us:%lld\r\n"
+                            "eventloop_max_busy_us:%lld\r\n",
+                            iterations, busy, poll,
+                            iterations ? busy / iterations : 0, maxbusy);
+    }
+    if (infoSection(section, "timers", &sections)) {
+        if (sections > 1) info = sdscat(info, "\r\n");
+        info = sdscatprintf(info,
+                            "# Timers\r\n"
+                            "pending_timers:%lu\r\n"
+                            "id_index_size:%lu\r\n"
+                            "id_index_used:%lu\r\n",
+                            pending, idsize, idused);
+        if (server.timer_backend == AE_TIMER_SKIPLIST)
+            info = sdscatprintf(info, "skiplist_max_level:%d\r\n", level);
+    }
+    if (infoSection(section, "shards", &sections)) {
+        if (sections > 1) info = sdscat(info, "\r\n");
+        info = sdscat(info, "# Shards\r\n");
+        for (j = 0; j < server.nshards; j++) {
+            taskShard* s = server.shards[j];
+            aeEventLoop* el = s->el;
+
+            info = sdscatprintf(info,
+                                "shard%d:clients=%u,timers=%lu,commands=%lld,"
+                                "fired=%lld,iterations=%lld,busy_us=%lld,"
+                                "poll_us=%lld,max_busy_us=%lld\r\n",
+                                j, listLength(s->clients),
+                                aePendingTimeEvents(el), s->stat_numcommands,
+                                s->stat_fired, el->stat_iterations,
+                                el->stat_busy_us, el->stat_poll_us,
+                                el->stat_max_busy_us);
+        }
+    }
+    if (infoSection(section, "keyspace", &sections)) {
+        if (sections > 1) info = sdscat(info, "\r\n");
+        info = sdscatprintf(info,
+                            "# Keyspace\r\n"
+                            "db%d:keys=%lu,slots=%lu,rehashing=%d\r\n",
+                            server.db->id, d->ht[0].used + d->ht[1].used,
+                            d->ht[0].size + d->ht[1].size,
+                            d->rehashidx != -1);
+    }
+    return info;
+}
+
+/* INFO [section] */
+void
+infoCommand(taskClient* c)
+{
+    char* section = c->argc == 2 ? c->argv[1]->ptr : NULL;
+
+    if (c->argc > 2) {
+        addReplySds(c, sdsnew("-ERR syntax error\r\n"));
+        return;
+    }
+    addReplyBulkSds(c, genInfoString(section));
+}
+
+/* Close once the replies of the commands before it were written. */
+void
+quitCommand(taskClient* c)
+{
+    addReply(c, shared.ok);
+    c->flags |= REDIS_CLOSE_AFTER_REPLY;
+}
+
 void
 getCommand(taskClient* c)
 {
@@ -325,70 +954,162 @@ getGenericCommand(taskClient* c)
     }
 }
 
+/* Delete the time event 'id' of the current shard. Returns 1 if it was
+ * pending, 0 otherwise. */
+int
+deleteTask(long long id)
+{
+    if (aeDeleteTimeEvent(myshard->el, id) == 0) {
+        redisLog(REDIS_VERBOSE, "Not found timerId: %lld", id);
+        return 0;
+    }
+    feedAppendOnlyFileDel(id);
+    myshard->stat_cancelled++;
+    return 1;
+}
+
 int
 delGenericCommand(taskClient* c)
 {
-    long long timeId = atoll(c->argv[1]->ptr);
+    long long timeId;
+    int owner;
 
-    dictEntry* de = dictFind(server.timer_dict, c->argv[1]);
-    if (de) {
-        robj* val = dictGetEntryVal(de);
-        long long score = atoll(val->ptr);
-        int del = aeDeleteTimeEvent(server.el, score, timeId);
-        if (del < 1) {
-            addReply(c, shared.notfound);
-            return REDIS_ERR;
-        }
-        addReply(c, shared.ok);
+    if (!string2ll(c->argv[1]->ptr, stringObjectLen(c->argv[1]), &timeId) ||
+        timeId < 0 || timeId % TASK_MAX_SHARDS >= server.nshards) {
+        addReply(c, shared.notfound);
+        return REDIS_ERR;
+    }
+    c->cmdtimeid = timeId;
+    owner = (int)(timeId % TASK_MAX_SHARDS);
+    if (owner != myshard->id) {
+        /* The owning shard answers through our inbox, until then the
+         * client does not run other commands so replies stay in order. */
+        shardMessage m = { .type = SHARD_MSG_DEL, .id = timeId, .c = c };
+        c->flags |= REDIS_BLOCKED;
+        postShardMessage(server.shards[owner], &m);
         return REDIS_OK;
-    } else {
-        redisLog(REDIS_ERR, "Not found timerId: %d", timeId);
+    }
+    if (!deleteTask(timeId)) {
         addReply(c, shared.notfound);
         return REDIS_ERR;
     }
+    addReply(c, shared.ok);
+    return REDIS_OK;
 }
 
-void
-addReply(taskClient* c, robj* obj)
+/* Queue the client in the shard pending writes list when it gets its first
+ * pending reply. Its output is written from beforeSleep, without a round
+ * trip through the event loop. */
+static int
+prepareClientToWrite(taskClient* c)
 {
-    if (listLength(c->reply) == 0 &&
-        aeCreateFileEvent(server.el, c->fd, AE_WRITABLE, sendReplyToClient,
-                          c) == AE_ERR) {
-        return;
+    if (c->fd == -1) return REDIS_ERR;
+    if (!(c->flags & REDIS_PENDING_WRITE) && c->bufpos == 0 &&
+        listLength(c->reply) == 0) {
+        c->flags |= REDIS_PENDING_WRITE;
+        listAddNodeHead(c->shard->clients_pending_write, c);
     }
-    listAddNodeTail(c->reply, getDecodedObject(obj));
+    return REDIS_OK;
 }
 
-void
-addReplytoWorker(timeEventObject* tobj, robj* obj)
+/* Append to the inline buffer. Fails once the overflow chain is in use, as
+ * the output would be reordered otherwise. */
+static int
+_addReplyToBuffer(taskClient* c, const char* s, size_t len)
 {
-    addReplyBulkList(tobj->message, obj);
+    if (listLength(c->reply) > 0) return REDIS_ERR;
+    if (len > sizeof(c->buf) - c->bufpos) return REDIS_ERR;
+    memcpy(c->buf + c->bufpos, s, len);
+    c->bufpos += len;
+    return REDIS_OK;
+}
+
+/* Append to the overflow chain, filling the last chunk before adding a new
+ * one. */
+static void
+_addReplyToList(taskClient* c, const char* s, size_t len)
+{
+    listNode* ln = listLast(c->reply);
+    sds tail = ln ? listNodeValue(ln) : NULL;
+
+    if (tail && sdslen(tail) + len <= REDIS_REPLY_CHUNK_BYTES) {
+        ln->value = sdscatlen(tail, (void*)s, len);
+    } else {
+        listAddNodeTail(c->reply, sdsnewlen(s, len));
+    }
 }
 
 void
-sendReplyToClient(aeEventLoop* el, int fd, void* privdata, int mask)
+addReplyString(taskClient* c, const char* s, size_t len)
 {
-    UNUSED(el);
-    UNUSED(mask);
-    taskClient* c = privdata;
-    int nwritten = 0, totwritten = 0, objlen;
-    robj* o;
+    if (prepareClientToWrite(c) != REDIS_OK) return;
+    if (_addReplyToBuffer(c, s, len) != REDIS_OK) _addReplyToList(c, s, len);
+}
 
-    while (listLength(c->reply)) {
-        o = listNodeValue(listFirst(c->reply));
-        objlen = sdslen(o->ptr);
+void
+addReply(taskClient* c, robj* obj)
+{
+    addReplyString(c, obj->ptr, stringObjectLen(obj));
+}
 
-        if (objlen == 0) {
-            listDelNode(c->reply, listFirst(c->reply));
-            continue;
+/* Write the inline buffer and the overflow chain with writev, up to
+ * REDIS_MAX_WRITE_PER_EVENT bytes. c->sentlen is the part of the inline
+ * buffer already written, or of the first chunk when the buffer is empty.
+ * Returns REDIS_ERR if the client was freed. */
+static int
+writeToClient(taskClient* c)
+{
+    struct iovec iov[REDIS_IOV_MAX];
+    int fd = c->fd;
+    ssize_t nwritten = 0, totwritten = 0;
+
+    while (c->bufpos > 0 || listLength(c->reply)) {
+        size_t skip = c->sentlen;
+        int iovcnt = 0;
+        listNode* ln;
+
+        if (c->bufpos > 0) {
+            iov[iovcnt].iov_base = c->buf + skip;
+            iov[iovcnt].iov_len = c->bufpos - skip;
+            iovcnt++;
+            skip = 0;
+        }
+        ln = listFirst(c->reply);
+        while (ln && iovcnt < REDIS_IOV_MAX) {
+            sds chunk = listNodeValue(ln);
+            iov[iovcnt].iov_base = chunk + skip;
+            iov[iovcnt].iov_len = sdslen(chunk) - skip;
+            iovcnt++;
+            skip = 0;
+            ln = listNextNode(ln);
         }
-        nwritten = write(fd, ((char*)o->ptr) + c->sentlen, objlen - c->sentlen);
+
+        nwritten = writev(fd, iov, iovcnt);
         if (nwritten <= 0) break;
-        c->sentlen += nwritten;
         totwritten += nwritten;
-        if (c->sentlen == objlen) {
-            listDelNode(c->reply, listFirst(c->reply));
+
+        /* Drop what was written, the buffer first. */
+        if (c->bufpos > 0) {
+            if ((size_t)nwritten < c->bufpos - c->sentlen) {
+                c->sentlen += nwritten;
+                nwritten = 0;
+            } else {
+                nwritten -= c->bufpos - c->sentlen;
+                c->bufpos = 0;
+                c->sentlen = 0;
+            }
+        }
+        while (nwritten > 0) {
+            sds chunk = listNodeValue(listFirst(c->reply));
+            size_t left = sdslen(chunk) - c->sentlen;
+
+            if ((size_t)nwritten < left) {
+                c->sentlen += nwritten;
+                break;
+            }
+            nwritten -= left;
             c->sentlen = 0;
+            listDelNode(c->reply, listFirst(c->reply));
         }
         if (totwritten > REDIS_MAX_WRITE_PER_EVENT) break;
     }
@@ -400,13 +1121,51 @@ sendReplyToClient(aeEventLoop* el, int fd, void* privdata, int mask)
             redisLog(REDIS_VERBOSE, "Error writing to client: %s",
                      strerror(errno));
             freeClient(c);
-            return;
+            return REDIS_ERR;
         }
     }
 
-    if (listLength(c->reply) == 0) {
+    if (c->bufpos == 0 && listLength(c->reply) == 0) {
         c->sentlen = 0;
-        aeDeleteFileEvent(server.el, c->fd, AE_WRITABLE);
+        if (aeGetFileEvents(c->shard->el, c->fd) & AE_WRITABLE)
+            aeDeleteFileEvent(c->shard->el, c->fd, AE_WRITABLE);
+        if (c->flags & REDIS_CLOSE_AFTER_REPLY) {
+            freeClient(c);
+            return REDIS_ERR;
+        }
+    }
+    return REDIS_OK;
+}
+
+void
+sendReplyToClient(aeEventLoop* el, int fd, void* privdata, int mask)
+{
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(mask);
+    writeToClient(privdata);
+}
+
+/* Called before sleeping: write the replies produced during this iteration.
+ * A writable handler is only installed for the clients whose socket could
+ * not take everything. */
+void
+handleClientsWithPendingWrites(void)
+{
+    list* pending = myshard->clients_pending_write;
+    listNode* ln;
+
+    while ((ln = listFirst(pending)) != NULL) {
+        taskClient* c = listNodeValue(ln);
+
+        c->flags &= ~REDIS_PENDING_WRITE;
+        listDelNode(pending, ln);
+        if (writeToClient(c) == REDIS_ERR) continue;
+        if ((c->bufpos || listLength(c->reply)) &&
+            !(aeGetFileEvents(c->shard->el, c->fd) & AE_WRITABLE) &&
+            aeCreateFileEvent(c->shard->el, c->fd, AE_WRITABLE,
+                              sendReplyToClient, c) == AE_ERR)
+            freeClient(c);
     }
 }
 
@@ -427,86 +1186,59 @@ setCommand(taskClient* c)
     setGenericCommand(c, 0, c->argv[1], c->argv[2], NULL);
 }
 
-void
-callWorker(char* addr, int port, list* msg)
-{
-    char* err = zmalloc(100 * sizeof(char));
-    int fd;
-    if ((fd = anetTcpConnect(err, addr, port)) == ANET_ERR) {
-        redisLog(REDIS_ERR, "connect error: %s\n", err);
-        zfree(err);
-        return;
-    }
-
-    listIter* iter = listGetIterator(msg, AL_START_HEAD);
-    listNode* node = NULL;
-    int nwritten = 0, totwritten = 0, objlen, sentlen = 0;
-    robj* o;
-
-    while ((node = listNext(iter))) {
-        o = listNodeValue(node);
-
-        objlen = sdslen(o->ptr);
-        if (objlen == 0) {
-            continue;
-        }
-        nwritten = write(fd, ((char*)o->ptr) + sentlen, objlen - sentlen);
-        if (nwritten <= 0) break;
-        sentlen += nwritten;
-        totwritten += nwritten;
-        if (sentlen == objlen) {
-            sentlen = 0;
-        }
-    }
-    close(fd);
-}
-
 int
 setGenericCommand(taskClient* c, int nx, robj* key, robj* val, robj* expire)
 {
     UNUSED(nx);
     UNUSED(expire);
     if (dictFind(c->db->dict, key) != NULL) {
-        dictReplace(c->db->dict, key, val);
-        incrRefCount(val);
+        dictReplace(c->db->dict, key, getDecodedObject(val));
         addReply(c, shared.ok);
         return REDIS_ERR;
     } else {
-        sds copy = sdsdup(key->ptr);
-        dictAdd(c->db->dict, createObject(REDIS_STRING, copy), val);
-        incrRefCount(val);
+        sds copy = sdsnewlen(key->ptr, stringObjectLen(key));
+        dictAdd(c->db->dict, createObject(REDIS_STRING, copy),
+                getDecodedObject(val));
         addReply(c, shared.ok);
         return REDIS_OK;
     }
 }
 
+/* Prepare the client for the next command. The bytes of the one that just
+ * ran are dropped from the query buffer by processInputBuffer. */
 void
 resetClient(taskClient* c)
 {
     freeClientArgv(c);
+    c->multibulklen = 0;
+    c->bulklen = -1;
+
+    /* Don't keep the slots of a command with many arguments around. */
+    if (c->argvcap > REDIS_MULTIBULK_PREALLOC)
+        resizeClientArgv(c, REDIS_MULTIBULK_PREALLOC);
 }
 
+/* Arguments are views into the query buffer, there is nothing to free. */
 void
 freeClientArgv(taskClient* c)
 {
-    int j;
-    for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
     c->argc = 0;
 }
 
 void
 addReplySds(taskClient* c, sds s)
 {
-    robj* o = createObject(REDIS_STRING, s);
-    addReply(c, o);
-    decrRefCount(o);
+    addReplyString(c, s, sdslen(s));
+    sdsfree(s);
 }
 
+/* Reply with 's' as a bulk string and free it. */
 void
-addReplyList(list* l, robj* obj)
+addReplyBulkSds(taskClient* c, sds s)
 {
-    listAddNodeTail(l, getDecodedObject(obj));
+    addReplySds(c, sdscatprintf(sdsempty(), "$%zu\r\n", sdslen(s)));
+    addReplySds(c, s);
+    addReply(c, shared.crlf);
 }
 
 robj*
@@ -525,21 +1257,14 @@ addReplyBulk(taskClient* c, robj* obj)
     addReply(c, shared.crlf);
 }
 
-void
-addReplyBulkList(list* l, robj* obj)
-{
-    addReplyBulkLenList(l, obj);
-    addReplyList(l, obj);
-    addReplyList(l, shared.crlf);
-}
-
 void
 addReplyBulkLen(taskClient* c, robj* obj)
 {
     size_t len, intlen;
     char buf[128];
-    if (obj->encoding == REDIS_ENCODING_RAW) {
-        len = sdslen(obj->ptr);
+    if (obj->encoding == REDIS_ENCODING_RAW ||
+        obj->encoding == REDIS_ENCODING_VIEW) {
+        len = stringObjectLen(obj);
     } else {
         long n = (long)obj->ptr;
         len = 1;
@@ -555,47 +1280,31 @@ addReplyBulkLen(taskClient* c, robj* obj)
     intlen = ll2string(buf + 1, sizeof(buf) - 1, (long long)len);
     buf[intlen + 1] = '\r';
     buf[intlen + 2] = '\n';
-    addReplySds(c, sdsnewlen(buf, intlen + 3));
+    addReplyString(c, buf, intlen + 3);
 }
 
-void
-addReplyBulkLenList(list* l, robj* obj)
+robj*
+makeObjectShared(robj* o)
 {
-    size_t len, intlen;
-    char buf[128];
-
-    if (obj->encoding == REDIS_ENCODING_RAW) {
-        len = sdslen(obj->ptr);
-    } else {
-        long n = (long)obj->ptr;
-        len = 1;
-        if (n < 0) {
-            len++;
-            n = -n;
-        }
-        while ((n = n / 10) != 0) {
-            len++;
-        }
-    }
-    buf[0] = '$';
-    intlen = ll2string(buf + 1, sizeof(buf) - 1, (long long)len);
-    buf[intlen + 1] = '\r';
-    buf[intlen + 2] = '\n';
-    addReplyList(l, createObject(REDIS_STRING, sdsnewlen(buf, intlen + 3)));
+    o->refcount = REDIS_SHARED_REFCOUNT;
+    return o;
 }
 
 void
 createSharedObjects(void)
 {
-    shared.crlf = createObject(REDIS_STRING, sdsnew("\r\n"));
-    shared.nullbulk = createObject(REDIS_STRING, sdsnew("$-1\r\n"));
-    shared.wrongtypeerr = createObject(
+    shared.crlf =
+      makeObjectShared(createObject(REDIS_STRING, sdsnew("\r\n")));
+    shared.nullbulk =
+      makeObjectShared(createObject(REDIS_STRING, sdsnew("$-1\r\n")));
+    shared.wrongtypeerr = makeObjectShared(createObject(
       REDIS_STRING,
-      sdsnew("-Operation against a key holding the wrong kind of value\r\n"));
-    shared.ok = createObject(REDIS_STRING, sdsnew("+OK\r\n"));
-    shared.notfound = createObject(REDIS_STRING, sdsnew("-key not found\r\n"));
-    shared.internelerr =
-      createObject(REDIS_STRING, sdsnew("-internal error\r\n"));
+      sdsnew("-Operation against a key holding the wrong kind of value\r\n")));
+    shared.ok = makeObjectShared(createObject(REDIS_STRING, sdsnew("+OK\r\n")));
+    shared.notfound = makeObjectShared(
+      createObject(REDIS_STRING, sdsnew("-key not found\r\n")));
+    shared.internelerr = makeObjectShared(
+      createObject(REDIS_STRING, sdsnew("-internal error\r\n")));
 }
 
 robj*
@@ -607,15 +1316,19 @@ lookupKeyRead(taskDb* db, robj* key)
 unsigned int
 dictObjHash(const void* key)
 {
-    const robj* o = key;
-    return dictGenHashFunction(o->ptr, sdslen((sds)o->ptr));
+    robj* o = (robj*)key;
+    return dictGenHashFunction(o->ptr, stringObjectLen(o));
 }
 
+/* Lookups are done with argument views, so compare by stringObjectLen. */
 int
 dictObjKeyCompare(void* privdata, const void* key1, const void* key2)
 {
-    const robj *o1 = key1, *o2 = key2;
-    return sdsDictKeyCompare(privdata, o1->ptr, o2->ptr);
+    UNUSED(privdata);
+    robj *o1 = (robj*)key1, *o2 = (robj*)key2;
+    size_t l1 = stringObjectLen(o1), l2 = stringObjectLen(o2);
+
+    return l1 == l2 && memcmp(o1->ptr, o2->ptr, l1) == 0;
 }
 
 void
@@ -631,6 +1344,7 @@ void
 decrRefCount(void* obj)
 {
     robj* o = obj;
+    if (o->refcount == REDIS_SHARED_REFCOUNT) return;
     if (--(o->refcount) == 0) {
         switch (o->type) {
             case REDIS_STRING:
@@ -640,7 +1354,7 @@ decrRefCount(void* obj)
                 freeListObject(o);
                 break;
         }
-        zfree(o);
+        poolFree(&objectPool, o);
     }
 }
 
@@ -669,95 +1383,139 @@ sdsDictKeyCompare(void* privdata, const void* key1, const void* key2)
     return memcmp(key1, key2, l1) == 0;
 }
 
+/* Return an object that can outlive the current command: argument views
+ * are copied, everything else gets one more reference. */
 robj*
 getDecodedObject(robj* o)
 {
-    if (o->encoding == REDIS_ENCODING_RAW) {
-        incrRefCount(o);
-        return o;
-    }
+    if (o->encoding == REDIS_ENCODING_VIEW)
+        return createObject(REDIS_STRING,
+                            sdsnewlen(o->ptr, stringObjectLen(o)));
+    incrRefCount(o);
+    return o;
 }
 
 void
 incrRefCount(robj* o)
 {
-    o->refcount++;
+    if (o->refcount != REDIS_SHARED_REFCOUNT) o->refcount++;
 }
 
 void
 rpcCommand(taskClient* c)
 {
-    timeEventObject* obj = zmalloc(sizeof(timeEventObject));
-    char* split = strchr(c->argv[3]->ptr, ':');
-    obj->port = atoi(split + 1);
-    obj->addr = sdsnewlen(c->argv[3]->ptr, split - (char*)c->argv[3]->ptr);
+    uint32_t endpoint;
+    if (internWorkerEndpoint(c->argv[3], &endpoint) == REDIS_ERR) {
+        static const char err[] = "-ERR invalid worker address\r\n";
+        addReplyString(c, err, sizeof(err) - 1);
+        return;
+    }
 
-    long long milliseconds;
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    milliseconds = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-    long long eventMilliSeconds = atoll(c->argv[2]->ptr);
-    long long unixSeconds;
+    /* Deadlines live on the monotonic clock of the loop. An argument later
+     * than the current unix time in ms is an absolute deadline, anything
+     * else is relative to now. */
+    long long now = aeMonotonicMs(myshard->el);
+    long long milliseconds = aeMonotonicToWall(myshard->el, now);
+    long long eventMilliSeconds, when, interval;
+    if (!string2ll(c->argv[2]->ptr, stringObjectLen(c->argv[2]),
+                   &eventMilliSeconds) ||
+        eventMilliSeconds < 0) {
+        static const char err[] = "-ERR invalid time\r\n";
+        addReplyString(c, err, sizeof(err) - 1);
+        return;
+    }
     if (eventMilliSeconds > milliseconds) {
-        obj->ttl = eventMilliSeconds - milliseconds;
-        unixSeconds = eventMilliSeconds;
+        interval = eventMilliSeconds - milliseconds;
+        when = aeWallToMonotonic(myshard->el, eventMilliSeconds);
     } else {
-        obj->ttl = eventMilliSeconds;
-        unixSeconds = eventMilliSeconds + milliseconds;
+        interval = eventMilliSeconds;
+        when = now + eventMilliSeconds;
     }
 
-    obj->message = listCreate();
-    obj->type =
+    int type =
       strcasecmp("once", c->argv[1]->ptr) == 0 ? TASK_ONCE : TASK_REPEAT;
-    robj* buf = createObject(REDIS_STRING, sdsdup(c->argv[4]->ptr));
-    addReplytoWorker(obj, getDecodedObject(buf));
-    long long timeId;
-    char time[32];
-    char timeVal[32];
-    if ((timeId = aeCreateTimeEvent(server.el, unixSeconds, obj->ttl,
-                                    notifyWorker, obj, finalizerTimeEvent)) ==
-        AE_ERR) {
-        redisLog(REDIS_NOTICE, "redis create task failed\n");
+    /* A repeat task is rescheduled by the int its time event returns, 0
+     * would fire it again on every loop iteration. The interval of a once
+     * task is never used, don't let it overflow the record and the AOF. */
+    if (type == TASK_ONCE) {
+        interval = 0;
+    } else if (interval <= 0) {
+        static const char err[] =
+          "-ERR repeat interval must be positive\r\n";
+        addReplyString(c, err, sizeof(err) - 1);
+        return;
+    } else if (interval > INT_MAX) {
+        static const char err[] = "-ERR repeat interval out of range\r\n";
+        addReplyString(c, err, sizeof(err) - 1);
+        return;
     }
+    taskRecord* task = createTaskRecord(type, interval, endpoint,
+                                        c->argv[4]->ptr,
+                                        stringObjectLen(c->argv[4]));
+
+    /* The time store maps the id straight to the embedded event, that is
+     * all del needs to find the task again. */
+    long long timeId = aeAddTimeEvent(myshard->el, &task->te, when,
+                                      notifyWorker, task, freeTaskRecord);
+    feedAppendOnlyFileTask(task);
+    c->cmdtimeid = timeId;
+    char reply[64];
+    int replylen =
+      snprintf(reply, sizeof(reply), "+OK timeEventId:%lld\r\n", timeId);
+    addReplyString(c, reply, replylen);
+}
 
-    sprintf(time, "%lld\n", timeId);
-    sprintf(timeVal, "%lld\n", unixSeconds);
-    robj* key = createObject(REDIS_STRING, sdsnew(strtok(time, "\n")));
-    robj* val = createObject(REDIS_STRING, sdsnew(strtok(timeVal, "\n")));
+/* Allocate a task record with room for a message of 'msglen' bytes, left
+ * to the caller to fill. */
+taskRecord*
+allocTaskRecord(int type, int interval, uint32_t endpoint, size_t msglen)
+{
+    taskRecord* task = zmalloc(sizeof(*task) + msglen);
 
-    if (dictFind(server.timer_dict, key) != NULL) {
-        dictReplace(server.timer_dict, key, val);
-        incrRefCount(val);
-    } else {
-        dictAdd(server.timer_dict, key, val);
-        incrRefCount(val);
-    }
-    dictEntry* de = dictFind(server.timer_dict, key);
-    robj* value = dictGetEntryVal(de);
-    addReply(c, createObject(
-                  REDIS_STRING,
-                  sdscatprintf(sdsempty(), "+OK timeEventId:%s\r\n", time)));
+    task->msglen = msglen;
+    task->endpoint = endpoint;
+    task->interval = interval;
+    task->type = type;
+    return task;
+}
+
+/* Allocate an unscheduled task. The payload is serialized once as a RESP
+ * bulk string, right after the record, every firing sends the same bytes. */
+taskRecord*
+createTaskRecord(int type, int interval, uint32_t endpoint,
+                 const char* payload, size_t len)
+{
+    char header[32];
+    int headerlen = snprintf(header, sizeof(header), "$%zu\r\n", len);
+    taskRecord* task =
+      allocTaskRecord(type, interval, endpoint, headerlen + len + 2);
+
+    memcpy(task->msg, header, headerlen);
+    memcpy(task->msg + headerlen, payload, len);
+    memcpy(task->msg + headerlen + len, "\r\n", 2);
+    return task;
 }
 
 void
-finalizerTimeEvent(struct aeEventLoop* eventLoop, void* clientData)
+freeTaskRecord(struct aeEventLoop* eventLoop, void* clientData)
 {
     UNUSED(eventLoop);
-    timeEventObject* obj = (timeEventObject*)clientData;
-    sdsfree(obj->addr);
-    listRelease(obj->message);
-    zfree(obj);
+    zfree(clientData);
 }
 
 int
 notifyWorker(struct aeEventLoop* eventLoop, long long id, void* clientData)
 {
     UNUSED(eventLoop);
-    UNUSED(id);
-    timeEventObject* obj = clientData;
-    callWorker(obj->addr, obj->port, obj->message);
-    if (obj->type != TASK_ONCE) {
-        return obj->ttl;
+    taskRecord* task = clientData;
+
+    myshard->stat_fired++;
+    if (dispatchToWorker(task->endpoint, task->msg, task->msglen) ==
+        REDIS_ERR)
+        myshard->stat_dispatch_failed++;
+    if (task->type != TASK_ONCE) {
+        return task->interval;
     }
+    feedAppendOnlyFileDel(id);
     return AE_NOMORE;
 }
@@ -1,6 +1,8 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
+#include "fmacros.h"
+
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,7 +12,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdint.h>
 #include <sys/time.h>
+#include <netinet/in.h>
 
 #include "ae.h"
 #include "sds.h"
@@ -19,6 +23,13 @@
 #include "adlist.h"
 #include "util.h"
 #include "anet.h"
+#include "pool.h"
+#include "monotonic.h"
+
+/* AOF fsync policies */
+#define AOF_FSYNC_NO 0
+#define AOF_FSYNC_ALWAYS 1   /* before replying, once per loop iteration */
+#define AOF_FSYNC_PERIODIC 2 /* every aof_fsync_period ms, in a thread */
 
 /* Object types */
 #define OBJ_STRING 0
@@ -37,9 +48,12 @@
 #define REDIS_NOTICE 2
 #define REDIS_WARNING 3
 
-#define REDIS_IOBUF_LEN 1024
+#define REDIS_IOBUF_LEN 1024               /* first and smallest read size */
+#define REDIS_IOBUF_MAX_LEN (1024 * 1024)  /* largest adaptive read size */
 #define REDIS_REQUEST_MAX_SIZE (1024 * 1024 * 256) /* max bytes in inline command */
 #define REDIS_MAX_WRITE_PER_EVENT (1024 * 64)
+#define REDIS_REPLY_CHUNK_BYTES (16 * 1024) /* inline buffer and chunk size */
+#define REDIS_IOV_MAX 128
 
 #define UNUSED(V) ((void) V)
 
@@ -57,6 +71,7 @@
 #define REDIS_ENCODING_INT 1    /* Encoded as integer */
 #define REDIS_ENCODING_ZIPMAP 2 /* Encoded as zipmap */
 #define REDIS_ENCODING_HT 3     /* Encoded as an hash table */
+#define REDIS_ENCODING_VIEW 4   /* Points into a client query buffer */
 
 /* Command flags */
 #define REDIS_CMD_BULK 1   /* Bulk write command */
@@ -67,13 +82,39 @@
                               In short this commands are denied on low memory conditions. */
 #define REDIS_CMD_DENYOOM 4
 #define REDIS_CMD_FORCE_REPLICATION 8 /* Force replication even if dirty is 0 */
-#define REDIS_CMD_NUM 3
 
 #define TASK_ONCE 1
 #define TASK_REPEAT 2
 
 #define REDIS_MIN_TIMESTAMP 1400000000
 
+/* Shared objects are never freed, and their refcount is left alone so that
+ * every shard can reply with them without touching shared memory. */
+#define REDIS_SHARED_REFCOUNT INT_MAX
+
+/* Client flags */
+#define REDIS_BLOCKED 1           /* waiting for another shard to answer */
+#define REDIS_CLOSE_AFTER_REPLY 2 /* close once the reply was written */
+#define REDIS_PENDING_WRITE 4     /* in the shard clients_pending_write */
+
+#define REDIS_MAX_MULTIBULK_LEN (1024 * 1024)
+#define REDIS_MULTIBULK_PREALLOC 1024 /* argv slots sized from the header */
+#define REDIS_MAX_HEADER_LEN (1024 * 64) /* longest '*' or '$' line */
+
+/* Shards. The owning shard of a time event is its id % TASK_MAX_SHARDS. */
+#define TASK_MAX_SHARDS 256
+#define TASK_DEFAULT_SHARDS 1
+
+/* Messages between shards */
+#define SHARD_MSG_CLIENT 0    /* take over the accepted connection 'fd' */
+#define SHARD_MSG_DEL 1       /* delete time event 'id' for client 'c' */
+#define SHARD_MSG_DEL_REPLY 2 /* result of a SHARD_MSG_DEL for client 'c' */
+#define SHARD_MSG_PAUSE 3     /* write the AOF buffer, wait for resume */
+#define SHARD_MSG_REWRITE 4   /* start an AOF rewrite, only to shard 0 */
+#define SHARD_MSG_BGSAVE 5    /* start a snapshot, only to shard 0 */
+#define SHARD_MSG_LATENCY_RESET 6 /* clear the latency histograms */
+#define SHARD_MSG_RESOLVED 7  /* lookup of endpoint 'id' done, see 'result' */
+
 typedef struct taskObject {
     void* ptr;
     unsigned char type;
@@ -83,49 +124,225 @@ typedef struct taskObject {
     int refcount;
 } robj;
 
+/* A command argument pointing into the client query buffer, NUL terminated
+ * in place. The robj comes first so that an argView can be used wherever a
+ * robj is expected, stringObjectLen() knows how to get its length. */
+typedef struct argView {
+    robj o;
+    size_t len;
+    size_t off; /* offset of the argument in querybuf */
+} argView;
+
 typedef struct taskDb {
     dict* dict;
     int id;
 } taskDb;
 
+/* A shard is one thread with its own event loop. It owns the clients it
+ * was handed, the time events they created and the connections to the
+ * workers those events are dispatched to, so shards only talk to each other
+ * through their inbox. */
+typedef struct taskShard {
+    int id;
+    pthread_t thread;
+    aeEventLoop* el;
+    int fd; /* own listening socket with --reuseport, -1 otherwise */
+    /* Statistics, only written by the shard thread. INFO reads them from
+     * other threads without locking. */
+    long long stat_connections;
+    long long stat_numcommands;
+    long long stat_fired;           /* task firings */
+    long long stat_cancelled;       /* tasks deleted by del */
+    long long stat_dispatch_failed; /* firings whose message was dropped */
+    long long stat_worker_errors;   /* worker connections failed */
+    list* clients;
+    list* clients_pending_write; /* replies to write before sleeping */
+    dict* workers; /* "addr:port" -> workerPool, interns the endpoints */
+    struct workerPool** endpoints; /* endpoint id -> workerPool */
+    uint32_t nendpoints;
+    uint32_t endpointscap;
+    pthread_mutex_t endpointslock; /* endpoints, for other threads */
+    list* worker_flush; /* workerConn with output to flush before sleep */
+    sds aofbuf;         /* AOF records to write before sleeping */
+    time_t lastcron;
+    pthread_mutex_t inboxlock;
+    list* inbox;   /* shardMessage posted by other shards */
+    int notify[2]; /* pipe waking up the loop when the inbox fills */
+} taskShard;
+
+typedef struct shardMessage {
+    int type;
+    int fd;
+    long long id;
+    int result;
+    struct taskClient* c;
+    taskShard* from;
+} shardMessage;
+
 typedef struct taskServer {
     pthread_t mainthread;
+    time_t stat_starttime;
     int port;
     int fd;
-    int stat_connections;
-    aeEventLoop* el;
+    int reuseport; /* every shard accepts on its own SO_REUSEPORT socket */
+    int timer_backend; /* AE_TIMER_SKIPLIST or AE_TIMER_WHEEL */
     char neterr[1024];
     char* bindaddr;
     char* logfile;
-    list* clients;
     taskDb* db;
-    dict *timer_dict;
+    dict* commands; /* command name -> taskCommand, read only after start */
+    int nshards;
+    taskShard** shards; /* shards[0] runs in the main thread */
+    int nextshard;      /* round robin for accepted connections */
+    int worker_max_conns;
+    int worker_idle_timeout;
+    /* Append only file */
+    int appendonly;
+    char* aof_filename;
+    int aof_fd;               /* -1 when the AOF is off */
+    int appendfsync;          /* AOF_FSYNC_* */
+    int aof_fsync_period;     /* ms, with AOF_FSYNC_PERIODIC */
+    pthread_mutex_t aof_lock; /* one shard writes to the file at a time */
+    off_t aof_current_size;
+    int aof_dirty;            /* written since the last periodic fsync */
+    pthread_t aof_fsync_thread;
+    pid_t aof_child_pid;      /* rewriting child, -1 if none */
+    sds aof_rewrite_buf;      /* records logged while the child runs */
+    off_t aof_rewrite_base_size; /* size after the last rewrite or load */
+    int aof_rewrite_perc;     /* rewrite when grown by this %, 0 never */
+    off_t aof_rewrite_min_size;
+    int aof_rewrite_scheduled; /* SHARD_MSG_REWRITE posted, not started */
+    /* Snapshot */
+    char* snapshot_filename;
+    pid_t snapshot_child_pid; /* saving child, -1 if none */
+    int snapshot_scheduled;   /* SHARD_MSG_BGSAVE posted, not started */
+    time_t snapshot_lastsave; /* last successful save */
+    /* Slow log */
+    long long slowlog_log_slower_than; /* us, -1 turns it off */
+    int slowlog_max_len;
 } taskServer;
 
 typedef struct taskClient {
     int fd;
+    int flags;
+    taskShard* shard;
     sds querybuf;
+    size_t qbpos;   /* first byte of querybuf not parsed yet */
+    size_t readlen; /* bytes asked to the next read, adapts to the traffic */
     int argc;
     robj** argv;
-    list* reply;
-    int sentlen;
+    argView* argvarena; /* argument headers, reused by every command */
+    int argvcap;        /* slots in argv and argvarena */
+    list* reply; /* sds chunks, used once buf is full */
+    size_t sentlen;
+    size_t bufpos;
+    char buf[REDIS_REPLY_CHUNK_BYTES];
     int multibulklen;
     int bulklen;
     taskDb* db;
     robj timeId;
+    long long cmdtimeid; /* created or deleted by the command, for SLOWLOG */
 } taskClient;
 
 struct sharedObjectStruct {
     robj *crlf, *nullbulk, *wrongtypeerr, *ok,*notfound,*internelerr;
-} shared;
+};
 
-typedef struct timeEventObject {
-    int port;
+
+/* Worker connection states */
+#define WORKER_CONNECTING 0
+#define WORKER_WRITING 1 /* socket full, waiting for AE_WRITABLE */
+#define WORKER_IDLE 2    /* connected, queued output is flushed before sleep */
+#define WORKER_FAILED 3
+
+#define WORKER_DEFAULT_MAX_CONNS 4
+#define WORKER_DEFAULT_IDLE_TIMEOUT 60 /* seconds */
+#define WORKER_POOL_MAX_FAILURES 3     /* consecutive, before marking down */
+#define WORKER_POOL_DOWN_TIME 5        /* seconds */
+#define WORKER_LOOKUP_QUEUE_MAX (1024 * 1024) /* bytes held during a lookup */
+#define WORKER_WRITE_MARKS 32 /* messages timed per connection at once */
+#define WORKER_OUTBUF_MAX (32 * 1024 * 1024) /* unwritten bytes per conn */
+
+/* A worker endpoint. Every distinct addr:port is interned once per shard
+ * and tasks refer to it by id. It caches the resolved address and owns the
+ * connections to the worker. */
+typedef struct workerPool {
+    uint32_t id;      /* index in myshard->endpoints */
     sds addr;
-    int ttl;
-    int type;
-    list* message;
-} timeEventObject;
+    int port;
+    struct sockaddr_in sa; /* resolved address, valid if 'resolved' */
+    int resolved;
+    /* A host name is looked up by a thread of its own, which fills these
+     * and posts SHARD_MSG_RESOLVED. They are not touched by the shard
+     * while 'resolving'. */
+    int resolving;
+    struct sockaddr_in lookupsa;
+    char lookuperr[ANET_ERR_LEN];
+    list* lookupqueue;  /* sds messages fired while 'resolving' */
+    size_t lookupbytes; /* their total size */
+    list* conns;      /* list of workerConn */
+    int failures;     /* consecutive failed connects/writes */
+    time_t downuntil; /* no dispatch to this endpoint before this time */
+    /* Latency, only written by the shard thread */
+    histogram stat_connect;    /* us from connect() to connected */
+    histogram stat_write;      /* us from dispatch to written to the socket */
+    histogram stat_queuedepth; /* bytes queued ahead of each message */
+} workerPool;
+
+/* A long lived, non blocking connection to a worker. */
+typedef struct workerConn {
+    int fd;
+    int state;
+    workerPool* pool;
+    sds outbuf;          /* serialized messages not written yet */
+    size_t sentlen;      /* bytes of outbuf already written */
+    int flushqueued;     /* already in server.worker_flush */
+    time_t lastinteraction;
+    monotime connectstart;
+    /* Dispatch time of the messages in outbuf, oldest first, to account
+     * their write completion. Counted in bytes ever queued so that the
+     * compaction of outbuf doesn't move them. Messages queued while the
+     * ring is full are not timed. */
+    unsigned long long queuedbytes;
+    unsigned long long writtenbytes;
+    struct {
+        unsigned long long end; /* queuedbytes once the message was added */
+        monotime queued;
+    } marks[WORKER_WRITE_MARKS];
+    int markfirst;
+    int nmarks;
+} workerConn;
+
+/* A pending task. The time event, the schedule and the message are a single
+ * allocation, and the timer index points straight at the embedded event, so
+ * firing a task only touches this record and the endpoint. The message is
+ * stored already serialized as the RESP bulk string sent to the worker. */
+typedef struct taskRecord {
+    aeTimeEvent te;
+    uint32_t endpoint;   /* id of the workerPool in the shard */
+    int interval;        /* ms between the firings of a repeat task */
+    int type;            /* TASK_ONCE or TASK_REPEAT */
+    unsigned int msglen;
+    char msg[];
+} taskRecord;
+
+/* A child forked by startBackgroundChild(): run() is called in the child,
+ * started() in the parent while the shards are still paused, and done() in
+ * the parent once the child exited, with 'ok' set if run() succeeded. */
+typedef struct backgroundChild {
+    char* name; /* for the logs */
+    int (*run)(void);
+    void (*started)(pid_t pid);
+    void (*done)(pid_t pid, int ok);
+} backgroundChild;
+
+/* A file written by a background child, in large chunks. */
+typedef struct childFile {
+    char* filename;
+    int fd;
+    sds buf;
+    int err; /* errno of the first failed write, 0 if none */
+} childFile;
 
 typedef void taskCommandProc(taskClient* c);
 
@@ -136,26 +353,38 @@ typedef struct taskCommand {
     int flags;
 }taskCommand;
 
+extern taskServer server;
+extern struct sharedObjectStruct shared;
+extern dictType workerPoolDictType;
+extern dictType dbDictType;
+extern __thread taskShard* myshard; /* shard of the running thread */
+
 void acceptHandler(aeEventLoop* el, int fd, void* privdata, int mask);
 void redisLog(int level, const char* fmt, ...);
 void call(taskClient* c, struct taskCommand* cmd);
 void readQueryFromCLient(aeEventLoop* el, int fd, void* privdata, int mask);
+taskClient* createClient(int fd);
 void freeClient(taskClient* c);
 void processInputBuffer(taskClient* c);
 int processCommand(taskClient* c);
 robj* createObject(int type, void* ptr);
+size_t stringObjectLen(robj* o);
 void addReply(taskClient* c, robj* obj);
 void sendReplyToClient(aeEventLoop* el, int fd, void* privdata, int mask);
 robj* lookupKey(taskDb* db, robj* key);
 void addReplyBulk(taskClient* c, robj* obj);
-struct taskCommand* lookupCommand(char* cmd);
+struct taskCommand* lookupCommand(robj* name);
+void populateCommandTable(void);
 int getGenericCommand(taskClient* c);
 void getCommand(taskClient* c);
 void setCommand(taskClient* c);
 void rpcCommand(taskClient* c);
 void delCommand(taskClient* c);
+void quitCommand(taskClient* c);
 void resetClient(taskClient* c);
 void addReplySds(taskClient* c, sds s);
+void addReplyBulkSds(taskClient* c, sds s);
+void addReplyString(taskClient* c, const char* s, size_t len);
 robj* lookupKeyReadOrReply(taskClient* c, robj* key, robj* reply);
 void createSharedObjects(void);
 void addReplyBulkLen(taskClient* c, robj* obj);
@@ -172,11 +401,60 @@ void freeClientArgv(taskClient* c);
 void freeListObject(robj* o);
 int setGenericCommand(taskClient* c, int nx, robj* key, robj* val, robj* expire);
 int delGenericCommand(taskClient* c);
+int deleteTask(long long id);
+void unblockClient(taskClient* c);
+robj* makeObjectShared(robj* o);
 int notifyWorker(struct aeEventLoop* eventLoop, long long id, void* clientData);
-void callWorker(char* addr, int port, list* message);
-void addReplyBulkList(list* l,robj* obj);
-void addReplyBulkLenList(list *l,robj* obj);
+int internWorkerEndpoint(robj* addr, uint32_t* id);
+int dispatchToWorker(uint32_t endpoint, const char* msg, size_t len);
+void workerPoolResolved(uint32_t endpoint, int result);
+void flushWorkerConns(void);
+void workerPoolCron(void);
+void beforeSleep(struct aeEventLoop* eventLoop);
+void handleClientsWithPendingWrites(void);
+taskShard* createShard(int id);
+void startShards(void);
+void postShardMessage(taskShard* s, shardMessage* m);
 void daemonize(void);
-void finalizerTimeEvent(struct aeEventLoop* eventLoop, void* clientData);
+long long ustime(void);
+long long mstime(void);
+taskRecord* allocTaskRecord(int type, int interval, uint32_t endpoint,
+                            size_t msglen);
+taskRecord* createTaskRecord(int type, int interval, uint32_t endpoint,
+                             const char* payload, size_t len);
+void freeTaskRecord(struct aeEventLoop* eventLoop, void* clientData);
+
+/* AOF */
+ssize_t aofWrite(int fd, const char* buf, size_t len);
+void feedAppendOnlyFileTask(taskRecord* task);
+void feedAppendOnlyFileDel(long long id);
+void flushAppendOnlyFile(void);
+void startAppendOnly(void);
+int loadAppendOnlyFile(char* filename);
+void requestAppendOnlyRewrite(void);
+int rewriteAppendOnlyFileBackground(void);
+void bgrewriteaofCommand(taskClient* c);
+void infoCommand(taskClient* c);
+void latencyCommand(taskClient* c);
+void resetLatencyHistograms(void);
+void slowlogInit(void);
+void slowlogPushEntryIfNeeded(robj** argv, int argc, long long timeid,
+                              long long duration);
+void slowlogTimeProc(aeEventLoop* el, aeTimeEvent* te, long long duration);
+void slowlogCommand(taskClient* c);
+
+/* Snapshot */
+int saveSnapshotBackground(void);
+void bgsaveCommand(taskClient* c);
+int loadSnapshot(char* filename);
+
+/* Background children */
+int startBackgroundChild(backgroundChild* bc);
+int childFileOpen(childFile* f, char* filename);
+void childFileWrite(childFile* f, const void* p, size_t len);
+int childFileClose(childFile* f);
+
+void pauseShards(void);
+void resumeShards(void);
 void unlinkClient(taskClient* c);
 #endif
@@ -0,0 +1,248 @@
+/* Shards.
+ *
+ * The server runs one shard per thread, each with its own aeEventLoop. A
+ * connection belongs to the shard it was handed to by acceptHandler, and
+ * the time events created by its rpc commands live in that shard, together
+ * with the pooled connections to the workers they fire to. Time event ids
+ * are allocated in steps of TASK_MAX_SHARDS starting at the shard id, so
+ * the owner of an id is id % TASK_MAX_SHARDS and a del for a task of
+ * another shard is posted straight to its inbox.
+ *
+ * The inbox is a list protected by a mutex. Posting to an empty inbox
+ * writes a byte to the shard notify pipe, which wakes up its loop. */
+
+#include "server.h"
+
+__thread taskShard* myshard;
+
+/* pauseShards() state */
+static pthread_mutex_t pauselock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pausecond = PTHREAD_COND_INITIALIZER;
+static int pausing;
+static int npaused;
+
+static void shardInboxHandler(aeEventLoop* el, int fd, void* privdata,
+                              int mask);
+
+taskShard*
+createShard(int id)
+{
+    taskShard* s = zmalloc(sizeof(*s));
+
+    s->id = id;
+    s->el = aeCreateEventLoop(1024 * 10);
+    aeSetTimerBackend(s->el, server.timer_backend);
+    aeSetTimeEventIdSpace(s->el, id, TASK_MAX_SHARDS);
+    aeSetBeforeSleepProc(s->el, beforeSleep);
+    /* beforeSleep runs workerPoolCron once a second. */
+    aeSetMaxWait(s->el, 1000);
+    if (server.slowlog_log_slower_than >= 0)
+        aeSetSlowTimeProc(s->el, slowlogTimeProc,
+                          server.slowlog_log_slower_than);
+    s->fd = -1;
+    s->stat_connections = 0;
+    s->stat_numcommands = 0;
+    s->stat_fired = 0;
+    s->stat_cancelled = 0;
+    s->stat_dispatch_failed = 0;
+    s->stat_worker_errors = 0;
+    s->clients = listCreate();
+    s->clients_pending_write = listCreate();
+    s->workers = dictCreate(&workerPoolDictType, NULL);
+    s->endpoints = NULL;
+    s->nendpoints = 0;
+    s->endpointscap = 0;
+    pthread_mutex_init(&s->endpointslock, NULL);
+    s->worker_flush = listCreate();
+    s->aofbuf = sdsempty();
+    s->lastcron = time(NULL);
+    pthread_mutex_init(&s->inboxlock, NULL);
+    s->inbox = listCreate();
+    if (pipe(s->notify) == -1) {
+        redisLog(REDIS_WARNING, "Can't create shard notify pipe: %s",
+                 strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL, s->notify[0]);
+    anetNonBlock(NULL, s->notify[1]);
+    if (aeCreateFileEvent(s->el, s->notify[0], AE_READABLE, shardInboxHandler,
+                          s) == AE_ERR) {
+        redisLog(REDIS_WARNING, "Can't watch shard notify pipe");
+        exit(1);
+    }
+    return s;
+}
+
+static void*
+shardMain(void* arg)
+{
+    taskShard* s = arg;
+
+    myshard = s;
+    aeMain(s->el);
+    return NULL;
+}
+
+/* Start a thread for every shard but the first, which is run by main(). */
+void
+startShards(void)
+{
+    int j;
+
+    for (j = 1; j < server.nshards; j++) {
+        taskShard* s = server.shards[j];
+
+        if (pthread_create(&s->thread, NULL, shardMain, s) != 0) {
+            redisLog(REDIS_WARNING, "Can't start shard %d thread", j);
+            exit(1);
+        }
+    }
+    server.shards[0]->thread = pthread_self();
+    myshard = server.shards[0];
+}
+
+/* Queue a copy of 'm' in the inbox of 's'. */
+void
+postShardMessage(taskShard* s, shardMessage* m)
+{
+    shardMessage* copy = zmalloc(sizeof(*copy));
+    int wakeup;
+
+    *copy = *m;
+    pthread_mutex_lock(&s->inboxlock);
+    listAddNodeTail(s->inbox, copy);
+    wakeup = listLength(s->inbox) == 1;
+    pthread_mutex_unlock(&s->inboxlock);
+
+    /* If the inbox was not empty the shard was already woken up and will
+     * find this message together with the others. */
+    if (wakeup && write(s->notify[1], "!", 1) == -1 && errno != EAGAIN)
+        redisLog(REDIS_WARNING, "Waking up shard %d: %s", s->id,
+                 strerror(errno));
+}
+
+/* Stop every other shard and return once they all are waiting for
+ * resumeShards(). A paused shard wrote its AOF buffer and holds no lock,
+ * so its memory can be snapshotted with fork(). */
+void
+pauseShards(void)
+{
+    shardMessage m = { .type = SHARD_MSG_PAUSE };
+    int j;
+
+    pthread_mutex_lock(&pauselock);
+    pausing = 1;
+    pthread_mutex_unlock(&pauselock);
+    for (j = 0; j < server.nshards; j++) {
+        if (server.shards[j] != myshard)
+            postShardMessage(server.shards[j], &m);
+    }
+
+    pthread_mutex_lock(&pauselock);
+    while (npaused < server.nshards - 1)
+        pthread_cond_wait(&pausecond, &pauselock);
+    pthread_mutex_unlock(&pauselock);
+}
+
+void
+resumeShards(void)
+{
+    pthread_mutex_lock(&pauselock);
+    pausing = 0;
+    pthread_cond_broadcast(&pausecond);
+    pthread_mutex_unlock(&pauselock);
+}
+
+static void
+waitForResume(void)
+{
+    flushAppendOnlyFile();
+    pthread_mutex_lock(&pauselock);
+    npaused++;
+    pthread_cond_broadcast(&pausecond);
+    while (pausing)
+        pthread_cond_wait(&pausecond, &pauselock);
+    npaused--;
+    pthread_mutex_unlock(&pauselock);
+}
+
+static void
+processShardMessage(taskShard* s, shardMessage* m)
+{
+    taskClient* c;
+
+    switch (m->type) {
+        case SHARD_MSG_CLIENT:
+            if (createClient(m->fd) == NULL) {
+                redisLog(REDIS_WARNING, "Error allocating client: %s",
+                         strerror(errno));
+                close(m->fd);
+            }
+            break;
+        case SHARD_MSG_DEL:
+            m->type = SHARD_MSG_DEL_REPLY;
+            m->result = deleteTask(m->id);
+            m->from = s;
+            /* The reply is written by the shard of the client, make sure
+             * the del is on disk before it can go out. */
+            if (m->result && server.appendfsync == AOF_FSYNC_ALWAYS)
+                flushAppendOnlyFile();
+            postShardMessage(m->c->shard, m);
+            break;
+        case SHARD_MSG_DEL_REPLY:
+            c = m->c;
+            if (c->fd == -1) {
+                /* The client went away while blocked. */
+                c->flags &= ~REDIS_BLOCKED;
+                freeClient(c);
+                break;
+            }
+            addReply(c, m->result ? shared.ok : shared.notfound);
+            unblockClient(c);
+            break;
+        case SHARD_MSG_PAUSE:
+            waitForResume();
+            break;
+        case SHARD_MSG_REWRITE:
+            rewriteAppendOnlyFileBackground();
+            break;
+        case SHARD_MSG_BGSAVE:
+            saveSnapshotBackground();
+            break;
+        case SHARD_MSG_LATENCY_RESET:
+            resetLatencyHistograms();
+            break;
+        case SHARD_MSG_RESOLVED:
+            workerPoolResolved(m->id, m->result);
+            break;
+    }
+}
+
+static void
+shardInboxHandler(aeEventLoop* el, int fd, void* privdata, int mask)
+{
+    UNUSED(el);
+    UNUSED(mask);
+    taskShard* s = privdata;
+    char buf[64];
+    list* inbox;
+    listNode* ln;
+
+    /* Drain the pipe before taking the messages, a post racing with us then
+     * always leaves a byte for the next wake up. */
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+    pthread_mutex_lock(&s->inboxlock);
+    inbox = s->inbox;
+    s->inbox = listCreate();
+    pthread_mutex_unlock(&s->inboxlock);
+
+    while ((ln = listFirst(inbox)) != NULL) {
+        shardMessage* m = listNodeValue(ln);
+
+        processShardMessage(s, m);
+        zfree(m);
+        listDelNode(inbox, ln);
+    }
+    listRelease(inbox);
+}
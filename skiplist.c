@@ -1,7 +1,12 @@
 #include <stdlib.h>
 #include "skiplist.h"
+#include "pool.h"
 #include "zmalloc.h"
-#include <stdlib.h>
+
+/* One node pool per height, nodes of a given height all have the same
+ * size. */
+static __thread objPool skiplistNodePools[SKIPLIST_MAXLEVEL];
+
 
 skiplist*
 createSkiplist(void)
@@ -16,15 +21,21 @@ createSkiplist(void)
         sl->header->level[j].forward = NULL;
         sl->header->level[j].span = 0;
     }
-    sl->dict = dictCreate(&dictTypeHeapStrings, NULL);
+    sl->ids = intMapCreate();
     return sl;
 }
 
 skiplistNode*
 createSkiplistNode(int level, long long score, void* obj, long long id)
 {
-    skiplistNode* node =
-      zmalloc(sizeof(*node) + level * sizeof(struct skiplistLevel));
+    objPool* pool = &skiplistNodePools[level - 1];
+    skiplistNode* node;
+
+    if (pool->size == 0)
+        pool->size =
+          POOL_ALIGN(sizeof(*node) + level * sizeof(struct skiplistLevel));
+    node = poolAlloc(pool);
+    node->levels = level;
     node->obj = obj;
     node->score = score;
     node->id = id;
@@ -35,22 +46,29 @@ void
 freeSkiplist(skiplist* sl)
 {
     skiplistNode *node = sl->header->level[0].forward, *next;
-    zfree(sl->header);
+    freeSkiplistNode(sl->header);
     while (node) {
         next = node->level[0].forward;
         freeSkiplistNode(node);
         node = next;
     }
-    dictRelease(sl->dict);
+    intMapRelease(sl->ids);
     zfree(sl);
 }
 
+/* The object of the node belongs to the caller and is not freed. */
 void
 freeSkiplistNode(skiplistNode* node)
 {
-    // node->obj must not be referenced
-    zfree(node->obj);
-    zfree(node);
+    poolFree(&skiplistNodePools[node->levels - 1], node);
+}
+
+/* Nodes are ordered by score, then by id, so timers sharing the same
+ * score can still be found and unlinked in O(log(N)). */
+static int
+skiplistNodeBefore(skiplistNode* x, long long score, long long id)
+{
+    return x->score < score || (x->score == score && x->id < id);
 }
 
 int
@@ -62,24 +80,27 @@ skiplistRandomLevel(void)
     return (level < SKIPLIST_MAXLEVEL) ? level : SKIPLIST_MAXLEVEL;
 }
 
-skiplistNode*
-skiplistInsert(skiplist* sl, long long score, void* obj, long long id)
+/* Link an already allocated node of the given level at the position of its
+ * (score, id). */
+static void
+skiplistLinkNode(skiplist* sl, skiplistNode* node, int level)
 {
     skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
     unsigned int rank[SKIPLIST_MAXLEVEL];
-    int i, level;
+    int i;
 
     x = sl->header;
     for (i = sl->level - 1; i >= 0; i--) {
         rank[i] = i == (sl->level - 1) ? 0 : rank[i + 1];
-        while (x->level[i].forward && x->level[i].forward->score < score) {
+        while (x->level[i].forward &&
+               skiplistNodeBefore(x->level[i].forward, node->score,
+                                  node->id)) {
             rank[i] += x->level[i].span;
             x = x->level[i].forward;
         }
         update[i] = x;
     }
 
-    level = skiplistRandomLevel();
     if (level > sl->level) {
         for (i = sl->level; i < level; i++) {
             rank[i] = 0;
@@ -89,7 +110,7 @@ skiplistInsert(skiplist* sl, long long score, void* obj, long long id)
         sl->level = level;
     }
 
-    x = createSkiplistNode(level, score, obj, id);
+    x = node;
     for (i = 0; i < level; i++) {
         x->level[i].forward = update[i]->level[i].forward;
         update[i]->level[i].forward = x;
@@ -102,10 +123,25 @@ skiplistInsert(skiplist* sl, long long score, void* obj, long long id)
         update[i]->level[i].span++;
     }
     sl->length++;
+}
 
+skiplistNode*
+skiplistInsert(skiplist* sl, long long score, void* obj, long long id)
+{
+    int level = skiplistRandomLevel();
+    skiplistNode* x = createSkiplistNode(level, score, obj, id);
+
+    skiplistLinkNode(sl, x, level);
+    intMapAdd(sl->ids, id, x);
     return x;
 }
 
+skiplistNode*
+skiplistFindById(skiplist* sl, long long id)
+{
+    return intMapFind(sl->ids, id);
+}
+
 void
 skiplistDeleteNode(skiplist* sl, skiplistNode* x, skiplistNode** update)
 {
@@ -123,29 +159,129 @@ skiplistDeleteNode(skiplist* sl, skiplistNode* x, skiplistNode** update)
     sl->length--;
 }
 
-int
-skiplistDelete(skiplist* sl, long long score, long long id)
+/* Fill 'update' with the rightmost node before (score, id) at every level
+ * and return the node matching (score, id), or NULL. */
+static skiplistNode*
+skiplistFind(skiplist* sl, long long score, long long id,
+             skiplistNode** update)
 {
-    skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+    skiplistNode* x;
     int i;
 
     x = sl->header;
     for (i = sl->level - 1; i >= 0; i--) {
-        while (x->level[i].forward && x->level[i].forward->score < score)
+        while (x->level[i].forward &&
+               skiplistNodeBefore(x->level[i].forward, score, id))
             x = x->level[i].forward;
         update[i] = x;
     }
     x = x->level[0].forward;
-    while (x && score == x->score) {
-        if (x->id == id) {
-            skiplistDeleteNode(sl, x, update);
-            freeSkiplistNode(x);
-            return 1;
-        } else {
-            x = x->level[0].forward;
-        }
+    if (x && score == x->score && x->id == id) return x;
+    return NULL;
+}
+
+/* Unlink the node matching (score, id) without freeing it. */
+skiplistNode*
+skiplistUnlink(skiplist* sl, long long score, long long id)
+{
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x;
+
+    if ((x = skiplistFind(sl, score, id, update)) == NULL) return NULL;
+    skiplistDeleteNode(sl, x, update);
+    intMapDelete(sl->ids, id);
+    return x;
+}
+
+int
+skiplistDelete(skiplist* sl, long long score, long long id)
+{
+    skiplistNode* x = skiplistUnlink(sl, score, id);
+
+    if (x == NULL) return 0;
+    freeSkiplistNode(x);
+    return 1;
+}
+
+/* Move the node matching (score, id) to 'newscore'. The node is reused, so
+ * rescheduling a repeat timer costs one search and no allocation. If the
+ * new score keeps the node between its neighbours only the score changes.
+ * Returns the node, or NULL if it was not found. */
+skiplistNode*
+skiplistUpdateScore(skiplist* sl, long long score, long long id,
+                    long long newscore)
+{
+    skiplistNode *update[SKIPLIST_MAXLEVEL], *x, *next;
+
+    if ((x = skiplistFind(sl, score, id, update)) == NULL) return NULL;
+
+    next = x->level[0].forward;
+    if ((update[0] == sl->header ||
+         skiplistNodeBefore(update[0], newscore, id)) &&
+        (next == NULL || !skiplistNodeBefore(next, newscore, id))) {
+        x->score = newscore;
+        return x;
+    }
+
+    skiplistDeleteNode(sl, x, update);
+    x->score = newscore;
+    skiplistLinkNode(sl, x, x->levels);
+    return x;
+}
+
+/* Fill 'tail' with the last node of every level of 'sl'. */
+void
+skiplistTailInit(skiplist* sl, skiplistTail* tail)
+{
+    skiplistNode* x = sl->header;
+    int i;
+
+    for (i = SKIPLIST_MAXLEVEL - 1; i >= 0; i--) {
+        while (x->level[i].forward)
+            x = x->level[i].forward;
+        tail->node[i] = x;
+    }
+}
+
+/* Insert a node in O(1) when it goes after every node of the list, which
+ * is how a list is rebuilt from nodes sorted by (score, id). 'tail' comes
+ * from skiplistTailInit() and is kept up to date, as long as the list is
+ * only changed through skiplistAppend() meanwhile. A node out of order is
+ * inserted the usual way. */
+skiplistNode*
+skiplistAppend(skiplist* sl, skiplistTail* tail, long long score, void* obj,
+               long long id)
+{
+    skiplistNode* last = tail->node[0];
+    skiplistNode* x;
+    int level, i;
+
+    if (last != sl->header && !skiplistNodeBefore(last, score, id)) {
+        x = skiplistInsert(sl, score, obj, id);
+        skiplistTailInit(sl, tail);
+        return x;
+    }
+
+    level = skiplistRandomLevel();
+    x = createSkiplistNode(level, score, obj, id);
+    if (level > sl->level) {
+        for (i = sl->level; i < level; i++)
+            sl->header->level[i].span = sl->length;
+        sl->level = level;
     }
-    return 0;
+    /* The span of a last node counts the nodes after it, none, so linking
+     * the new node makes it one more. */
+    for (i = 0; i < level; i++) {
+        tail->node[i]->level[i].forward = x;
+        tail->node[i]->level[i].span++;
+        x->level[i].forward = NULL;
+        x->level[i].span = 0;
+        tail->node[i] = x;
+    }
+    for (i = level; i < sl->level; i++)
+        tail->node[i]->level[i].span++;
+    sl->length++;
+    intMapAdd(sl->ids, id, x);
+    return x;
 }
 
 int
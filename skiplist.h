@@ -6,12 +6,13 @@
 #define SKIP_OK 0
 #define SKIP_ERR -1
 
-#include "dict.h"
+#include "intmap.h"
 typedef struct skiplistNode
 {
     void* obj;
     long long score;
     long long id;
+    int levels; /* entries in level[] */
     struct skiplistLevel
     {
         struct skiplistNode* forward;
@@ -25,9 +26,15 @@ typedef struct skiplist
     int (*compare)(void* a, void* b);
     unsigned long length;
     int level;
-    dict* dict;
+    intMap* ids; /* id -> node, scores of repeat timers move */
 } skiplist;
 
+/* Last node of every level, to append nodes in order without searching. */
+typedef struct skiplistTail
+{
+    skiplistNode* node[SKIPLIST_MAXLEVEL];
+} skiplistTail;
+
 skiplist* createSkiplist(void);
 skiplistNode* createSkiplistNode(int level, long long score, void* obj,
                                  long long id);
@@ -36,5 +43,12 @@ void freeSkiplistNode(skiplistNode* node);
 skiplistNode* skiplistInsert(skiplist* sl, long long score, void* obj,
                              long long id);
 int skiplistDelete(skiplist* sl, long long score, long long id);
+skiplistNode* skiplistFindById(skiplist* sl, long long id);
+skiplistNode* skiplistUnlink(skiplist* sl, long long score, long long id);
+skiplistNode* skiplistUpdateScore(skiplist* sl, long long score, long long id,
+                                  long long newscore);
 int skiplistDeleteHeader(skiplist* sl);
+void skiplistTailInit(skiplist* sl, skiplistTail* tail);
+skiplistNode* skiplistAppend(skiplist* sl, skiplistTail* tail,
+                             long long score, void* obj, long long id);
 #endif
@@ -0,0 +1,228 @@
+/* Slow log.
+ *
+ * Every command, and every time event callback, that ran for at least
+ * slowlog_log_slower_than microseconds is remembered in a ring of the last
+ * slowlog_max_len entries, with its arguments, the time id it worked on and
+ * how long it took. A single slow command or firing stalls every other
+ * client and timer of its shard, the log is where to find it.
+ *
+ * The shards share the ring under a mutex. It is only taken for commands
+ * and callbacks that were slow in the first place, and by SLOWLOG. */
+
+#include "server.h"
+
+#define SLOWLOG_ENTRY_MAX_ARGC 32
+#define SLOWLOG_ENTRY_MAX_STRING 128
+
+typedef struct slowlogEntry {
+    long long id; /* unique, increasing */
+    time_t time;  /* unix time of the end of the command */
+    long long duration; /* us */
+    long long timeid;   /* time event created, deleted or fired, or -1 */
+    int shard;
+    int argc;
+    sds* argv;
+} slowlogEntry;
+
+static pthread_mutex_t slowloglock = PTHREAD_MUTEX_INITIALIZER;
+static slowlogEntry* slowlog; /* ring of slowlog_max_len entries */
+static unsigned long slowloglen;
+static unsigned long slowlognext; /* slot the next entry goes to */
+static long long slowlogid;
+
+/* An empty ring. Slots never used are zeroed. */
+static slowlogEntry*
+createSlowlogRing(void)
+{
+    size_t size = sizeof(slowlogEntry) * server.slowlog_max_len;
+
+    return memset(zmalloc(size), 0, size);
+}
+
+void
+slowlogInit(void)
+{
+    slowlog = createSlowlogRing();
+    slowloglen = 0;
+    slowlognext = 0;
+    slowlogid = 0;
+}
+
+static void
+freeSlowlogEntry(slowlogEntry* se)
+{
+    int j;
+
+    for (j = 0; j < se->argc; j++)
+        sdsfree(se->argv[j]);
+    zfree(se->argv);
+}
+
+/* Copy of 'len' bytes at 'p', cut to SLOWLOG_ENTRY_MAX_STRING. */
+static sds
+slowlogString(const char* p, size_t len)
+{
+    sds s;
+
+    if (len <= SLOWLOG_ENTRY_MAX_STRING) return sdsnewlen(p, len);
+    s = sdsnewlen(p, SLOWLOG_ENTRY_MAX_STRING);
+    return sdscatprintf(s, "... (%zu more bytes)",
+                        len - SLOWLOG_ENTRY_MAX_STRING);
+}
+
+/* Add an entry taking ownership of 'argv', dropping the oldest one if the
+ * ring is full. */
+static void
+slowlogPush(sds* argv, int argc, long long timeid, long long duration)
+{
+    slowlogEntry se, old;
+
+    se.time = time(NULL);
+    se.duration = duration;
+    se.timeid = timeid;
+    se.shard = myshard->id;
+    se.argc = argc;
+    se.argv = argv;
+
+    pthread_mutex_lock(&slowloglock);
+    se.id = slowlogid++;
+    old = slowlog[slowlognext];
+    slowlog[slowlognext] = se;
+    slowlognext = (slowlognext + 1) % server.slowlog_max_len;
+    if (slowloglen < (unsigned long)server.slowlog_max_len) slowloglen++;
+    pthread_mutex_unlock(&slowloglock);
+
+    if (old.argv) freeSlowlogEntry(&old);
+}
+
+/* Log the command 'argv' if it took more than slowlog_log_slower_than. */
+void
+slowlogPushEntryIfNeeded(robj** argv, int argc, long long timeid,
+                         long long duration)
+{
+    int slargc = argc, j;
+    sds* slargv;
+
+    if (server.slowlog_log_slower_than < 0 ||
+        duration < server.slowlog_log_slower_than)
+        return;
+
+    if (slargc > SLOWLOG_ENTRY_MAX_ARGC) slargc = SLOWLOG_ENTRY_MAX_ARGC;
+    slargv = zmalloc(sizeof(sds) * slargc);
+    for (j = 0; j < slargc; j++) {
+        /* The last slot tells how many arguments were left out. */
+        if (slargc != argc && j == slargc - 1)
+            slargv[j] = sdscatprintf(sdsempty(), "... (%d more arguments)",
+                                     argc - slargc + 1);
+        else
+            slargv[j] = slowlogString(argv[j]->ptr, stringObjectLen(argv[j]));
+    }
+    slowlogPush(slargv, slargc, timeid, duration);
+}
+
+/* aeSlowTimeProc of the shards: log a task that was slow to fire as
+ * "fire", its type, its endpoint and its message. Other time events only
+ * get "timer" and their id. */
+void
+slowlogTimeProc(aeEventLoop* el, aeTimeEvent* te, long long duration)
+{
+    UNUSED(el);
+    taskRecord* task;
+    workerPool* pool;
+    char* payload;
+    sds* argv;
+
+    if (te->finalizerProc != freeTaskRecord) {
+        argv = zmalloc(sizeof(sds) * 2);
+        argv[0] = sdsnew("timer");
+        argv[1] = sdscatprintf(sdsempty(), "%lld", te->id);
+        slowlogPush(argv, 2, te->id, duration);
+        return;
+    }
+
+    task = te->clientData;
+    pool = myshard->endpoints[task->endpoint];
+    payload = memchr(task->msg, '\n', task->msglen) + 1;
+    argv = zmalloc(sizeof(sds) * 4);
+    argv[0] = sdsnew("fire");
+    argv[1] = sdsnew(task->type == TASK_ONCE ? "once" : "repeat");
+    argv[2] = sdscatprintf(sdsempty(), "%s:%d", pool->addr, pool->port);
+    /* Skip the RESP framing of the stored message. */
+    argv[3] = slowlogString(payload,
+                            task->msglen - (payload - task->msg) - 2);
+    slowlogPush(argv, 4, te->id, duration);
+}
+
+/* SLOWLOG GET [count]
+ * SLOWLOG LEN
+ * SLOWLOG RESET */
+void
+slowlogCommand(taskClient* c)
+{
+    static const char syntaxerr[] = "-ERR syntax error\r\n";
+    char* sub = c->argv[1]->ptr;
+
+    if (c->argc == 2 && !strcasecmp(sub, "reset")) {
+        slowlogEntry* old = slowlog;
+        unsigned long j;
+
+        pthread_mutex_lock(&slowloglock);
+        slowlog = createSlowlogRing();
+        slowloglen = 0;
+        slowlognext = 0;
+        pthread_mutex_unlock(&slowloglock);
+        for (j = 0; j < (unsigned long)server.slowlog_max_len; j++)
+            if (old[j].argv) freeSlowlogEntry(&old[j]);
+        zfree(old);
+        addReply(c, shared.ok);
+    } else if (c->argc == 2 && !strcasecmp(sub, "len")) {
+        unsigned long len;
+
+        pthread_mutex_lock(&slowloglock);
+        len = slowloglen;
+        pthread_mutex_unlock(&slowloglock);
+        addReplySds(c, sdscatprintf(sdsempty(), ":%lu\r\n", len));
+    } else if ((c->argc == 2 || c->argc == 3) && !strcasecmp(sub, "get")) {
+        long long count = 10;
+        unsigned long j, slot;
+        sds reply;
+        int k;
+
+        if (c->argc == 3 &&
+            (!string2ll(c->argv[2]->ptr, stringObjectLen(c->argv[2]),
+                        &count) ||
+             count < 0)) {
+            addReplyString(c, syntaxerr, sizeof(syntaxerr) - 1);
+            return;
+        }
+
+        /* Newest first, as an array of [id, time, duration, [args...],
+         * time id, shard] per entry. */
+        pthread_mutex_lock(&slowloglock);
+        if ((unsigned long long)count > slowloglen) count = slowloglen;
+        reply = sdscatprintf(sdsempty(), "*%lld\r\n", count);
+        slot = slowlognext;
+        for (j = 0; j < (unsigned long)count; j++) {
+            slowlogEntry* se;
+
+            slot = (slot + server.slowlog_max_len - 1) %
+                   server.slowlog_max_len;
+            se = &slowlog[slot];
+            reply = sdscatprintf(reply,
+                                 "*6\r\n:%lld\r\n:%ld\r\n:%lld\r\n*%d\r\n",
+                                 se->id, (long)se->time, se->duration,
+                                 se->argc);
+            for (k = 0; k < se->argc; k++) {
+                reply = sdscatprintf(reply, "$%zu\r\n", sdslen(se->argv[k]));
+                reply = sdscatlen(reply, se->argv[k], sdslen(se->argv[k]));
+                reply = sdscatlen(reply, "\r\n", 2);
+            }
+            reply = sdscatprintf(reply, ":%lld\r\n:%d\r\n", se->timeid,
+                                 se->shard);
+        }
+        pthread_mutex_unlock(&slowloglock);
+        addReplySds(c, reply);
+    } else {
+        addReplyString(c, syntaxerr, sizeof(syntaxerr) - 1);
+    }
+}
@@ -0,0 +1,410 @@
+/* Binary snapshot of the pending tasks.
+ *
+ * The append only file replays every change, which is slow to reload once
+ * tens of millions of tasks are pending. A snapshot is a point in time copy
+ * of the tasks laid out to be loaded straight from an mmap of the file:
+ *
+ *   header     snapshotHeader
+ *   endpoints  nendpoints times a 16 bit length and an "addr:port"
+ *   tasks      ntasks snapshotTask, sorted by deadline then id
+ *   messages   the message of every task, in the order of the tasks
+ *
+ * Integers are stored in the byte order of the host that wrote the file, a
+ * snapshot from a host with another byte order is refused. Messages are
+ * stored as the RESP bulk strings sent to the workers, as in taskRecord.
+ *
+ * BGSAVE forks like an AOF rewrite does (see child.c): the first shard
+ * pauses the others, forks, and the child writes the tasks of every shard
+ * to a temporary file renamed over the snapshot once complete. Only one child
+ * runs at a time, a BGSAVE during an AOF rewrite starts when it is done
+ * and the other way around.
+ *
+ * As the tasks come sorted, loading links every time event after the
+ * previous one of its shard (see aeBeginRestore) instead of searching its
+ * place, and sizes the id indexes once. */
+
+#include "server.h"
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "TASKSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTEORDER 0x01020304
+
+/* The loader prefetches the id index slot of the task this far ahead. */
+#define SNAPSHOT_PREFETCH 32
+
+typedef struct snapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder; /* SNAPSHOT_BYTEORDER as the writer stores it */
+    uint32_t nendpoints;
+    uint32_t reserved;
+    uint64_t ntasks;
+    int64_t created;     /* unix milliseconds */
+    uint64_t tasksoff;   /* offset of the tasks, 8 bytes aligned */
+    uint64_t messageoff; /* offset of the messages */
+    uint64_t size;       /* of the whole file, catches a truncated copy */
+} snapshotHeader;
+
+typedef struct snapshotTask {
+    int64_t id;
+    int64_t deadline; /* unix milliseconds */
+    uint64_t msgoff;  /* from the start of the messages */
+    uint32_t msglen;
+    uint32_t endpoint; /* index in the endpoints */
+    int32_t interval;
+    int32_t type;
+} snapshotTask;
+
+/* A task collected by the child, with the record its message is in. */
+typedef struct snapshotEntry {
+    snapshotTask st;
+    taskRecord* task;
+} snapshotEntry;
+
+typedef struct snapshotState {
+    taskShard* shard;
+    uint32_t epbase; /* index of the first endpoint of the shard */
+    snapshotEntry* entries;
+    size_t count;
+    size_t cap;
+} snapshotState;
+
+static sds
+snapshotTempFileName(pid_t pid)
+{
+    return sdscatprintf(sdsempty(), "%s.temp-%d", server.snapshot_filename,
+                        (int)pid);
+}
+
+static void
+snapshotCollectTask(aeTimeEvent* te, void* privdata)
+{
+    snapshotState* ss = privdata;
+    taskRecord* task = te->clientData;
+    snapshotEntry* e;
+
+    /* Only tasks are saved. */
+    if (te->finalizerProc != freeTaskRecord) return;
+    if (ss->count == ss->cap) {
+        ss->cap = ss->cap ? ss->cap * 2 : 1024;
+        ss->entries = zrealloc(ss->entries, sizeof(snapshotEntry) * ss->cap);
+    }
+    e = ss->entries + ss->count++;
+    e->st.id = te->id;
+    e->st.deadline = aeMonotonicToWall(ss->shard->el, te->when);
+    e->st.msglen = task->msglen;
+    e->st.endpoint = ss->epbase + task->endpoint;
+    e->st.interval = task->interval;
+    e->st.type = task->type;
+    e->task = task;
+}
+
+static int
+snapshotEntryCompare(const void* a, const void* b)
+{
+    const snapshotTask *x = &((snapshotEntry*)a)->st,
+                       *y = &((snapshotEntry*)b)->st;
+
+    if (x->deadline != y->deadline) return x->deadline < y->deadline ? -1 : 1;
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/* Write every pending task of every shard to a temporary file. Runs in the
+ * child, which has a frozen copy of the shards. */
+static int
+writeSnapshot(void)
+{
+    sds tmpfile = snapshotTempFileName(getpid());
+    snapshotState ss = { 0 };
+    snapshotHeader hdr;
+    childFile f;
+    sds endpoints = sdsempty();
+    uint64_t msgoff = 0, tasksoff;
+    size_t j;
+    int k;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+    for (k = 0; k < server.nshards; k++) {
+        taskShard* s = server.shards[k];
+        uint32_t e;
+
+        ss.shard = s;
+        ss.epbase = hdr.nendpoints;
+        aeForEachTimeEvent(s->el, snapshotCollectTask, &ss);
+        for (e = 0; e < s->nendpoints; e++) {
+            workerPool* pool = s->endpoints[e];
+            char port[16];
+            int portlen = ll2string(port, sizeof(port), pool->port);
+            uint16_t len = sdslen(pool->addr) + 1 + portlen;
+
+            endpoints = sdscatlen(endpoints, &len, sizeof(len));
+            endpoints = sdscatlen(endpoints, pool->addr, sdslen(pool->addr));
+            endpoints = sdscatlen(endpoints, ":", 1);
+            endpoints = sdscatlen(endpoints, port, portlen);
+        }
+        hdr.nendpoints += s->nendpoints;
+    }
+    qsort(ss.entries, ss.count, sizeof(snapshotEntry), snapshotEntryCompare);
+    for (j = 0; j < ss.count; j++) {
+        ss.entries[j].st.msgoff = msgoff;
+        msgoff += ss.entries[j].st.msglen;
+    }
+
+    tasksoff = (sizeof(hdr) + sdslen(endpoints) + 7) & ~(uint64_t)7;
+    hdr.version = SNAPSHOT_VERSION;
+    hdr.byteorder = SNAPSHOT_BYTEORDER;
+    hdr.ntasks = ss.count;
+    hdr.created = mstime();
+    hdr.tasksoff = tasksoff;
+    hdr.messageoff = tasksoff + sizeof(snapshotTask) * ss.count;
+    hdr.size = hdr.messageoff + msgoff;
+
+    if (childFileOpen(&f, tmpfile) == REDIS_ERR) {
+        redisLog(REDIS_WARNING, "Opening the temp file for the snapshot: %s",
+                 strerror(errno));
+        return REDIS_ERR;
+    }
+    childFileWrite(&f, &hdr, sizeof(hdr));
+    childFileWrite(&f, endpoints, sdslen(endpoints));
+    childFileWrite(&f, "\0\0\0\0\0\0\0", tasksoff - sizeof(hdr) -
+                                          sdslen(endpoints));
+    for (j = 0; j < ss.count; j++)
+        childFileWrite(&f, &ss.entries[j].st, sizeof(snapshotTask));
+    for (j = 0; j < ss.count; j++)
+        childFileWrite(&f, ss.entries[j].task->msg, ss.entries[j].st.msglen);
+    if (childFileClose(&f) == REDIS_ERR) {
+        redisLog(REDIS_WARNING, "Writing the snapshot: %s", strerror(f.err));
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+static void
+backgroundSaveStarted(pid_t pid)
+{
+    pthread_mutex_lock(&server.aof_lock);
+    server.snapshot_child_pid = pid;
+    server.snapshot_scheduled = 0;
+    pthread_mutex_unlock(&server.aof_lock);
+}
+
+static void
+backgroundSaveDone(pid_t pid, int ok)
+{
+    sds tmpfile = snapshotTempFileName(pid);
+    int rewrite, saved = 0;
+
+    if (!ok) {
+        unlink(tmpfile);
+    } else if (rename(tmpfile, server.snapshot_filename) == -1) {
+        redisLog(REDIS_WARNING, "Renaming the snapshot: %s", strerror(errno));
+        unlink(tmpfile);
+    } else {
+        saved = 1;
+        redisLog(REDIS_NOTICE, "Background saving terminated with success");
+    }
+    sdsfree(tmpfile);
+
+    pthread_mutex_lock(&server.aof_lock);
+    if (saved) server.snapshot_lastsave = time(NULL);
+    server.snapshot_child_pid = -1;
+    rewrite = server.aof_rewrite_scheduled;
+    pthread_mutex_unlock(&server.aof_lock);
+    if (rewrite) rewriteAppendOnlyFileBackground();
+}
+
+static backgroundChild saveChild = { "saving", writeSnapshot,
+                                     backgroundSaveStarted,
+                                     backgroundSaveDone };
+
+static void
+setSaveScheduled(int scheduled)
+{
+    pthread_mutex_lock(&server.aof_lock);
+    server.snapshot_scheduled = scheduled;
+    pthread_mutex_unlock(&server.aof_lock);
+}
+
+/* Fork a child saving the pending tasks. Runs in the first shard. */
+int
+saveSnapshotBackground(void)
+{
+    /* Started again when the AOF rewrite is done. */
+    if (server.aof_child_pid != -1) return REDIS_ERR;
+    if (startBackgroundChild(&saveChild) == REDIS_ERR) {
+        setSaveScheduled(0);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+void
+bgsaveCommand(taskClient* c)
+{
+    static const char busy[] = "-ERR Background save already in progress\r\n";
+    static const char started[] = "+Background saving started\r\n";
+    static const char scheduled[] = "+Background saving scheduled\r\n";
+    shardMessage m = { .type = SHARD_MSG_BGSAVE };
+    int running, rewriting;
+
+    pthread_mutex_lock(&server.aof_lock);
+    running = server.snapshot_child_pid != -1 || server.snapshot_scheduled;
+    rewriting = server.aof_child_pid != -1;
+    if (!running) server.snapshot_scheduled = 1;
+    pthread_mutex_unlock(&server.aof_lock);
+    if (running) {
+        addReplyString(c, busy, sizeof(busy) - 1);
+        return;
+    }
+    /* Forks only happen in the first shard, one at a time. */
+    postShardMessage(server.shards[0], &m);
+    if (rewriting)
+        addReplyString(c, scheduled, sizeof(scheduled) - 1);
+    else
+        addReplyString(c, started, sizeof(started) - 1);
+}
+
+static void
+snapshotFormatError(char* filename, const char* what)
+{
+    redisLog(REDIS_WARNING, "Bad snapshot %s: %s", filename, what);
+    exit(1);
+}
+
+/* Rebuild the pending tasks from a snapshot. Called at startup, before the
+ * shards run, so it can schedule tasks in any of them. Returns REDIS_ERR if
+ * there is no file. */
+int
+loadSnapshot(char* filename)
+{
+    struct redis_stat sb;
+    snapshotHeader* hdr;
+    snapshotTask* tasks;
+    const char *map, *p, *messages;
+    robj** endpoints;
+    uint32_t* local; /* shard * nendpoints + endpoint -> endpoint id */
+    taskShard* saved = myshard;
+    long long start = ustime();
+    uint64_t j;
+    int fd, k;
+
+    if ((fd = open(filename, O_RDONLY)) == -1) {
+        if (errno == ENOENT) return REDIS_ERR;
+        redisLog(REDIS_WARNING, "Can't open the snapshot %s: %s", filename,
+                 strerror(errno));
+        exit(1);
+    }
+    if (redis_fstat(fd, &sb) == -1) {
+        redisLog(REDIS_WARNING, "Can't stat the snapshot %s: %s", filename,
+                 strerror(errno));
+        exit(1);
+    }
+    if ((size_t)sb.st_size < sizeof(*hdr))
+        snapshotFormatError(filename, "truncated header");
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        redisLog(REDIS_WARNING, "Can't map the snapshot %s: %s", filename,
+                 strerror(errno));
+        exit(1);
+    }
+    close(fd);
+    madvise((void*)map, sb.st_size, MADV_SEQUENTIAL);
+
+    hdr = (snapshotHeader*)map;
+    if (memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)))
+        snapshotFormatError(filename, "not a snapshot");
+    if (hdr->byteorder != SNAPSHOT_BYTEORDER)
+        snapshotFormatError(filename, "written with another byte order");
+    if (hdr->version != SNAPSHOT_VERSION)
+        snapshotFormatError(filename, "unknown version");
+    if (hdr->size != (uint64_t)sb.st_size || hdr->tasksoff % 8 ||
+        hdr->tasksoff < sizeof(*hdr) || hdr->tasksoff > hdr->size ||
+        hdr->ntasks > (hdr->size - hdr->tasksoff) / sizeof(snapshotTask) ||
+        hdr->messageoff !=
+          hdr->tasksoff + hdr->ntasks * sizeof(snapshotTask))
+        snapshotFormatError(filename, "truncated or corrupted");
+    tasks = (snapshotTask*)(map + hdr->tasksoff);
+    messages = map + hdr->messageoff;
+
+    /* Endpoints are interned in a shard the first time one of its tasks
+     * uses them. */
+    endpoints = zmalloc(sizeof(robj*) * hdr->nendpoints);
+    p = map + sizeof(*hdr);
+    for (j = 0; j < hdr->nendpoints; j++) {
+        uint16_t len;
+
+        if (p + sizeof(len) > map + hdr->tasksoff)
+            snapshotFormatError(filename, "truncated endpoints");
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        if (p + len > map + hdr->tasksoff)
+            snapshotFormatError(filename, "truncated endpoints");
+        endpoints[j] = createObject(REDIS_STRING, sdsnewlen(p, len));
+        p += len;
+    }
+    local = zmalloc(sizeof(uint32_t) * hdr->nendpoints * server.nshards);
+    memset(local, 0xff, sizeof(uint32_t) * hdr->nendpoints * server.nshards);
+
+    for (k = 0; k < server.nshards; k++)
+        aeBeginRestore(server.shards[k]->el, hdr->ntasks / server.nshards);
+    for (j = 0; j < hdr->ntasks; j++) {
+        snapshotTask* st = tasks + j;
+        uint32_t* endpoint;
+        taskRecord* task;
+        int shard = st->id % TASK_MAX_SHARDS;
+
+        if (j + SNAPSHOT_PREFETCH < hdr->ntasks) {
+            long long next = tasks[j + SNAPSHOT_PREFETCH].id;
+
+            if (next >= 0 && next % TASK_MAX_SHARDS < server.nshards)
+                aePrefetchTimeEvent(
+                  server.shards[next % TASK_MAX_SHARDS]->el, next);
+        }
+
+        if (st->endpoint >= hdr->nendpoints || st->msglen < 5 ||
+            st->msgoff > hdr->size - hdr->messageoff ||
+            st->msglen > hdr->size - hdr->messageoff - st->msgoff ||
+            st->interval < 0 ||
+            (st->type != TASK_ONCE && st->type != TASK_REPEAT) || st->id < 0)
+            snapshotFormatError(filename, "bad task");
+        if (shard >= server.nshards) {
+            redisLog(REDIS_WARNING,
+                     "The snapshot has tasks of shard %d, start the server "
+                     "with --shards %d or more",
+                     shard, shard + 1);
+            exit(1);
+        }
+        myshard = server.shards[shard];
+
+        endpoint = local + shard * hdr->nendpoints + st->endpoint;
+        if (*endpoint == UINT32_MAX &&
+            internWorkerEndpoint(endpoints[st->endpoint], endpoint) ==
+              REDIS_ERR)
+            snapshotFormatError(filename, "bad endpoint");
+
+        task = allocTaskRecord(st->type, st->interval, *endpoint, st->msglen);
+        memcpy(task->msg, messages + st->msgoff, st->msglen);
+        if (aeRestoreTimeEvent(myshard->el, &task->te, st->id,
+                               aeWallToMonotonic(myshard->el, st->deadline),
+                               notifyWorker, task, freeTaskRecord) == AE_ERR)
+            snapshotFormatError(filename, "duplicated task id");
+    }
+    for (k = 0; k < server.nshards; k++)
+        aeEndRestore(server.shards[k]->el);
+
+    for (j = 0; j < hdr->nendpoints; j++)
+        decrRefCount(endpoints[j]);
+    zfree(endpoints);
+    zfree(local);
+    redisLog(REDIS_NOTICE, "Loaded %llu tasks from the snapshot in %.3f "
+                           "seconds",
+             (unsigned long long)hdr->ntasks, (ustime() - start) / 1e6);
+    munmap((void*)map, sb.st_size);
+    myshard = saved;
+    return REDIS_OK;
+}
@@ -0,0 +1,475 @@
+/* rpc submit benchmark.
+ *
+ * Opens one blocking connection per client thread and submits commands in
+ * pipelined batches, then reports the aggregate throughput and the
+ * percentiles of the time each command waited for its reply. By default
+ * every command is an 'rpc once' scheduled one hour ahead, so none of the
+ * tasks fires during the run.
+ *
+ * -m mixes in 'rpc repeat' and 'del'. A del removes the oldest task the
+ * client created and did not delete yet, or is sent as an 'rpc once' when
+ * there is none. -f draws the delay of every task from a distribution and
+ * -d its payload size from a range; with short delays and -w pointing to a
+ * worker, the firing and dispatch paths are loaded too.
+ *
+ * With -r the clients send their batches on a fixed schedule instead of as
+ * fast as they can. The latency of a command is then measured from when its
+ * batch was due, not from when it went out, so a server that stalls shows
+ * up in the percentiles instead of just slowing the clients down.
+ *
+ * To see how the server scales with cores, run it against servers started
+ * with a growing number of shards:
+ *
+ *   for n in 1 2 4 8 16 32; do
+ *       ./server --shards $n & sleep 1
+ *       ./task-benchmark -c 64 -n 2000000
+ *       kill %1; wait
+ *   done
+ */
+
+#include "fmacros.h"
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "anet.h"
+#include "histogram.h"
+#include "sds.h"
+#include "util.h"
+
+#define CMD_ONCE 0
+#define CMD_REPEAT 1
+#define CMD_DEL 2
+
+#define FIRE_FIXED 0
+#define FIRE_UNIFORM 1
+#define FIRE_EXP 2
+
+static struct config
+{
+    char* host;
+    int port;
+    int clients;
+    long long requests;
+    int pipeline;
+    int datamin; /* payload sizes are uniform in [datamin, datamax] */
+    int datamax;
+    double rate;    /* commands per second over all clients, 0 unlimited */
+    int mix[3];     /* weights of CMD_ONCE, CMD_REPEAT and CMD_DEL */
+    int mixtotal;
+    int firedist;   /* FIRE_* */
+    long long firemin; /* ms, the delay with FIRE_FIXED, mean of FIRE_EXP */
+    long long firemax; /* ms, upper bound with FIRE_UNIFORM */
+    char* worker;
+    sds workerbulk; /* 'worker' as a bulk string */
+    char* payload;  /* datamax bytes */
+} config;
+
+typedef struct benchClient
+{
+    pthread_t thread;
+    long long requests; /* commands this client has to submit */
+    long long done;
+    long long sent[3]; /* per CMD_* */
+    int failed;
+    uint64_t rng;
+    long long* ids; /* created by this client and not deleted yet */
+    size_t idfirst;
+    size_t idlast;
+    size_t idcap;
+    sds replies; /* partial reply line */
+    histogram latency; /* us */
+} benchClient;
+
+static long long
+ustime(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* xorshift64*, one state per client so the threads share nothing. */
+static uint64_t
+nextRandom(benchClient* bc)
+{
+    bc->rng ^= bc->rng >> 12;
+    bc->rng ^= bc->rng << 25;
+    bc->rng ^= bc->rng >> 27;
+    return bc->rng * 2685821657736338717ULL;
+}
+
+/* Uniform in [0, 1). */
+static double
+nextDouble(benchClient* bc)
+{
+    return (nextRandom(bc) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static long long
+fireDelay(benchClient* bc)
+{
+    switch (config.firedist) {
+        case FIRE_UNIFORM:
+            return config.firemin +
+                   (long long)(nextRandom(bc) %
+                               (config.firemax - config.firemin + 1));
+        case FIRE_EXP:
+            return (long long)(-log(1 - nextDouble(bc)) * config.firemin);
+        default:
+            return config.firemin;
+    }
+}
+
+static int
+pickCommand(benchClient* bc)
+{
+    int r = (int)(nextRandom(bc) % config.mixtotal), type;
+
+    for (type = CMD_ONCE; type < CMD_DEL; type++) {
+        if (r < config.mix[type]) break;
+        r -= config.mix[type];
+    }
+    if (type == CMD_DEL && bc->idfirst == bc->idlast) type = CMD_ONCE;
+    return type;
+}
+
+/* Append "$<len>\r\n", the header of a bulk string of 'len' bytes. */
+static sds
+catBulkHeader(sds s, long long len)
+{
+    char buf[32];
+
+    buf[0] = '$';
+    len = 1 + ll2string(buf + 1, sizeof(buf) - 3, len);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    return sdscatlen(s, buf, len);
+}
+
+static sds
+catBulkNumber(sds s, long long value)
+{
+    char buf[32];
+    int len = ll2string(buf, sizeof(buf), value);
+
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+    s = catBulkHeader(s, len - 2);
+    return sdscatlen(s, buf, len);
+}
+
+/* Append the next command of 'bc' to 'batch'. */
+static sds
+catCommand(benchClient* bc, sds batch)
+{
+    static const char once[] = "*5\r\n$3\r\nrpc\r\n$4\r\nonce\r\n";
+    static const char repeat[] = "*5\r\n$3\r\nrpc\r\n$6\r\nrepeat\r\n";
+    static const char del[] = "*2\r\n$3\r\ndel\r\n";
+    int type = pickCommand(bc), size;
+
+    bc->sent[type]++;
+    if (type == CMD_DEL) {
+        batch = sdscatlen(batch, (char*)del, sizeof(del) - 1);
+        return catBulkNumber(batch, bc->ids[bc->idfirst++]);
+    }
+
+    if (type == CMD_ONCE)
+        batch = sdscatlen(batch, (char*)once, sizeof(once) - 1);
+    else
+        batch = sdscatlen(batch, (char*)repeat, sizeof(repeat) - 1);
+    batch = catBulkNumber(batch, fireDelay(bc));
+    batch = sdscatlen(batch, config.workerbulk, sdslen(config.workerbulk));
+    size = config.datamin;
+    if (config.datamax > config.datamin)
+        size += (int)(nextRandom(bc) % (config.datamax - config.datamin + 1));
+    batch = catBulkHeader(batch, size);
+    batch = sdscatlen(batch, config.payload, size);
+    return sdscatlen(batch, "\r\n", 2);
+}
+
+/* Remember the id of a task the client created, for a later del. */
+static void
+addTaskId(benchClient* bc, long long id)
+{
+    if (bc->idlast == bc->idcap) {
+        /* Reuse the room of the ids deleted already before growing. */
+        if (bc->idfirst > bc->idcap / 2) {
+            memmove(bc->ids, bc->ids + bc->idfirst,
+                    sizeof(long long) * (bc->idlast - bc->idfirst));
+            bc->idlast -= bc->idfirst;
+            bc->idfirst = 0;
+        } else {
+            bc->idcap = bc->idcap ? bc->idcap * 2 : 1024;
+            bc->ids = realloc(bc->ids, sizeof(long long) * bc->idcap);
+        }
+    }
+    bc->ids[bc->idlast++] = id;
+}
+
+/* Read until 'count' replies, one line each, were received, and account
+ * them as sent at 'start'. */
+static int
+readReplies(benchClient* bc, int fd, int count, long long start)
+{
+    static const char idfield[] = "timeEventId:";
+    char buf[16 * 1024];
+
+    while (count > 0) {
+        ssize_t nread = read(fd, buf, sizeof(buf));
+        long long now = ustime();
+        char *line, *nl;
+
+        if (nread <= 0) return -1;
+        bc->replies = sdscatlen(bc->replies, buf, nread);
+        line = bc->replies;
+        while (count > 0 &&
+               (nl = memchr(line, '\n', bc->replies + sdslen(bc->replies) -
+                                            line)) != NULL) {
+            char* id;
+
+            *nl = '\0';
+            if (config.mix[CMD_DEL] && line[0] == '+' &&
+                (id = strstr(line, idfield)) != NULL)
+                addTaskId(bc, strtoll(id + sizeof(idfield) - 1, NULL, 10));
+            histogramRecord(&bc->latency, now - start);
+            count--;
+            line = nl + 1;
+        }
+        bc->replies = sdsrange(bc->replies, line - bc->replies, -1);
+    }
+    return 0;
+}
+
+static void*
+benchClientMain(void* arg)
+{
+    benchClient* bc = arg;
+    char err[ANET_ERR_LEN];
+    sds batch = sdsempty();
+    double interval = 0; /* us between batches with a rate */
+    long long start, due;
+    int fd;
+
+    if ((fd = anetTcpConnect(err, config.host, config.port)) == ANET_ERR) {
+        fprintf(stderr, "Connecting to %s:%d: %s\n", config.host, config.port,
+                err);
+        bc->failed = 1;
+        goto done;
+    }
+    anetTcpNoDelay(NULL, fd);
+    if (config.rate > 0)
+        interval = config.pipeline * 1e6 * config.clients / config.rate;
+
+    start = ustime();
+    while (bc->done < bc->requests) {
+        long long n = bc->requests - bc->done, now = ustime(), j;
+
+        if (n > config.pipeline) n = config.pipeline;
+        due = now;
+        if (interval > 0) {
+            due = start + (long long)(bc->done / config.pipeline * interval);
+            if (due > now) usleep(due - now);
+        }
+        for (j = 0; j < n; j++)
+            batch = catCommand(bc, batch);
+        if (anetWrite(fd, batch, sdslen(batch)) != (int)sdslen(batch) ||
+            readReplies(bc, fd, n, due) == -1) {
+            fprintf(stderr, "Connection lost: %s\n", strerror(errno));
+            bc->failed = 1;
+            break;
+        }
+        batch = sdsrange(batch, 1, 0); /* empty, keeping the buffer */
+        bc->done += n;
+    }
+    close(fd);
+done:
+    sdsfree(batch);
+    return NULL;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "Usage: ./task-benchmark [-h <host>] [-p <port>] [-c <clients>]\n"
+            "                        [-n <requests>] [-P <pipeline>] "
+            "[-d <size>[-<max>]]\n"
+            "                        [-r <rate>] [-m <once:repeat:del>] "
+            "[-f <delay>] [-w <addr>]\n\n"
+            " -h <host>      Server hostname (default 127.0.0.1)\n"
+            " -p <port>      Server port (default 6379)\n"
+            " -c <clients>   Parallel connections, one thread each "
+            "(default 50)\n"
+            " -n <requests>  Total number of commands (default 1000000)\n"
+            " -P <pipeline>  Commands sent per round trip (default 16)\n"
+            " -d <size>      Payload size in bytes, or a min-max range "
+            "(default 32)\n"
+            " -r <rate>      Commands per second over all the clients "
+            "(default unlimited)\n"
+            " -m <weights>   Mix of rpc once, rpc repeat and del "
+            "(default 1:0:0)\n"
+            " -f <delay>     Task delays in ms: <ms>, uniform:<min>:<max> "
+            "or exp:<mean>\n"
+            "                (default 3600000)\n"
+            " -w <addr>      Worker of the tasks (default 127.0.0.1:9)\n");
+    exit(1);
+}
+
+static void
+parseMix(char* arg)
+{
+    if (sscanf(arg, "%d:%d:%d", &config.mix[CMD_ONCE], &config.mix[CMD_REPEAT],
+               &config.mix[CMD_DEL]) != 3 ||
+        config.mix[CMD_ONCE] < 0 || config.mix[CMD_REPEAT] < 0 ||
+        config.mix[CMD_DEL] < 0)
+        usage();
+}
+
+static void
+parseFireDelay(char* arg)
+{
+    if (!strncmp(arg, "uniform:", 8)) {
+        config.firedist = FIRE_UNIFORM;
+        if (sscanf(arg + 8, "%lld:%lld", &config.firemin, &config.firemax) !=
+              2 ||
+            config.firemax < config.firemin)
+            usage();
+    } else if (!strncmp(arg, "exp:", 4)) {
+        config.firedist = FIRE_EXP;
+        config.firemin = atoll(arg + 4);
+    } else {
+        config.firedist = FIRE_FIXED;
+        config.firemin = atoll(arg);
+    }
+    if (config.firemin < 0) usage();
+}
+
+int
+main(int argc, char** argv)
+{
+    benchClient* clients;
+    long long start, elapsed, done = 0, sent[3] = { 0, 0, 0 };
+    histogram latency;
+    int j, failed = 0;
+
+    config.host = "127.0.0.1";
+    config.port = 6379;
+    config.clients = 50;
+    config.requests = 1000000;
+    config.pipeline = 16;
+    config.datamin = config.datamax = 32;
+    config.rate = 0;
+    config.mix[CMD_ONCE] = 1;
+    config.mix[CMD_REPEAT] = 0;
+    config.mix[CMD_DEL] = 0;
+    config.firedist = FIRE_FIXED;
+    config.firemin = 3600000;
+    config.worker = "127.0.0.1:9";
+    for (j = 1; j < argc; j++) {
+        int lastarg = j == argc - 1;
+
+        if (!strcmp(argv[j], "-h") && !lastarg) {
+            config.host = argv[++j];
+        } else if (!strcmp(argv[j], "-p") && !lastarg) {
+            config.port = atoi(argv[++j]);
+        } else if (!strcmp(argv[j], "-c") && !lastarg) {
+            config.clients = atoi(argv[++j]);
+        } else if (!strcmp(argv[j], "-n") && !lastarg) {
+            config.requests = atoll(argv[++j]);
+        } else if (!strcmp(argv[j], "-P") && !lastarg) {
+            config.pipeline = atoi(argv[++j]);
+        } else if (!strcmp(argv[j], "-d") && !lastarg) {
+            char* range = strchr(argv[++j], '-');
+
+            config.datamin = config.datamax = atoi(argv[j]);
+            if (range) config.datamax = atoi(range + 1);
+        } else if (!strcmp(argv[j], "-r") && !lastarg) {
+            config.rate = atof(argv[++j]);
+        } else if (!strcmp(argv[j], "-m") && !lastarg) {
+            parseMix(argv[++j]);
+        } else if (!strcmp(argv[j], "-f") && !lastarg) {
+            parseFireDelay(argv[++j]);
+        } else if (!strcmp(argv[j], "-w") && !lastarg) {
+            config.worker = argv[++j];
+        } else {
+            usage();
+        }
+    }
+    config.mixtotal =
+      config.mix[CMD_ONCE] + config.mix[CMD_REPEAT] + config.mix[CMD_DEL];
+    if (config.clients < 1 || config.requests < 1 || config.pipeline < 1 ||
+        config.datamin < 0 || config.datamax < config.datamin ||
+        config.rate < 0 || config.mixtotal < 1 ||
+        config.mix[CMD_ONCE] + config.mix[CMD_REPEAT] < 1)
+        usage();
+    config.payload = malloc(config.datamax + 1);
+    memset(config.payload, 'x', config.datamax);
+    config.workerbulk = catBulkHeader(sdsempty(), strlen(config.worker));
+    config.workerbulk = sdscatprintf(config.workerbulk, "%s\r\n",
+                                     config.worker);
+
+    clients = calloc(config.clients, sizeof(*clients));
+    for (j = 0; j < config.clients; j++) {
+        clients[j].requests = config.requests / config.clients +
+                              (j < config.requests % config.clients);
+        clients[j].rng = 0x9e3779b97f4a7c15ULL * (j + 1);
+        clients[j].replies = sdsempty();
+        histogramReset(&clients[j].latency);
+    }
+
+    start = ustime();
+    for (j = 0; j < config.clients; j++) {
+        if (pthread_create(&clients[j].thread, NULL, benchClientMain,
+                           &clients[j]) != 0) {
+            fprintf(stderr, "Can't start client thread\n");
+            exit(1);
+        }
+    }
+    histogramReset(&latency);
+    for (j = 0; j < config.clients; j++) {
+        benchClient* bc = &clients[j];
+
+        pthread_join(bc->thread, NULL);
+        done += bc->done;
+        sent[CMD_ONCE] += bc->sent[CMD_ONCE];
+        sent[CMD_REPEAT] += bc->sent[CMD_REPEAT];
+        sent[CMD_DEL] += bc->sent[CMD_DEL];
+        failed |= bc->failed;
+        histogramMerge(&latency, &bc->latency);
+        sdsfree(bc->replies);
+        free(bc->ids);
+    }
+    elapsed = ustime() - start;
+
+    printf("rpc: %lld requests completed in %.2f seconds\n", done,
+           elapsed / 1e6);
+    printf("  %d parallel clients, pipeline %d, ", config.clients,
+           config.pipeline);
+    if (config.datamin == config.datamax)
+        printf("%d bytes payload\n", config.datamin);
+    else
+        printf("%d-%d bytes payload\n", config.datamin, config.datamax);
+    printf("  %lld rpc once, %lld rpc repeat, %lld del\n", sent[CMD_ONCE],
+           sent[CMD_REPEAT], sent[CMD_DEL]);
+    printf("  %.2f requests per second", elapsed ? done * 1e6 / elapsed : 0);
+    if (config.rate > 0) printf(" (target %.2f)", config.rate);
+    printf("\n");
+    printf("  latency us: p50 %llu, p99 %llu, p999 %llu, max %llu\n",
+           (unsigned long long)histogramPercentile(&latency, 50),
+           (unsigned long long)histogramPercentile(&latency, 99),
+           (unsigned long long)histogramPercentile(&latency, 99.9),
+           (unsigned long long)latency.max);
+    free(clients);
+    free(config.payload);
+    sdsfree(config.workerbulk);
+    return failed;
+}
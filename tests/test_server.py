@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+"""End to end checks of the server.
+
+Starts ./server (it listens on port 6379) and a fake worker, talks RESP to
+the server and looks at what the worker receives. Run with make test. """
+
+import os
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+SERVER_PORT = 6379
+
+
+class Worker:
+    """Accepts connections and records every byte sent to it."""
+
+    def __init__(self):
+        self.sock = socket.socket()
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(("127.0.0.1", 0))
+        self.sock.listen(64)
+        self.port = self.sock.getsockname()[1]
+        self.lock = threading.Lock()
+        self.data = b""
+        threading.Thread(target=self.accept, daemon=True).start()
+
+    def accept(self):
+        while True:
+            conn, _ = self.sock.accept()
+            threading.Thread(target=self.read, args=(conn,),
+                             daemon=True).start()
+
+    def read(self, conn):
+        while True:
+            chunk = conn.recv(65536)
+            if not chunk:
+                break
+            with self.lock:
+                self.data += chunk
+
+    def wait_for(self, needle, timeout=3.0):
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            with self.lock:
+                if needle in self.data:
+                    return True
+            time.sleep(0.01)
+        return False
+
+
+def encode(*args):
+    out = b"*%d\r\n" % len(args)
+    for a in args:
+        a = a.encode() if isinstance(a, str) else a
+        out += b"$%d\r\n%s\r\n" % (len(a), a)
+    return out
+
+
+class Client:
+    def __init__(self):
+        self.sock = socket.create_connection(("127.0.0.1", SERVER_PORT))
+        self.sock.settimeout(3)
+
+    def send(self, raw):
+        self.sock.sendall(raw)
+        return self.sock.recv(65536)
+
+    def call(self, *args):
+        return self.send(encode(*args))
+
+
+def start_server(*args):
+    proc = subprocess.Popen([os.path.join(ROOT, "server")] + list(args),
+                            stdout=subprocess.DEVNULL,
+                            stderr=subprocess.DEVNULL)
+    deadline = time.time() + 5
+    while time.time() < deadline:
+        try:
+            socket.create_connection(("127.0.0.1", SERVER_PORT)).close()
+            return proc
+        except OSError:
+            time.sleep(0.05)
+    proc.kill()
+    raise RuntimeError("server did not start")
+
+
+def test_hostname_endpoint_due_now(worker):
+    """A task due right away at a host name endpoint waits for the lookup
+    instead of being dropped."""
+    c = Client()
+    reply = c.call("rpc", "once", "0", "localhost:%d" % worker.port,
+                   "hostname-due-now")
+    assert reply.startswith(b"+OK"), reply
+    assert worker.wait_for(b"hostname-due-now"), "message not delivered"
+
+
+def test_repeat_interval_zero(worker):
+    """A repeat task every 0 ms would fire on every loop iteration."""
+    c = Client()
+    reply = c.call("rpc", "repeat", "0", "127.0.0.1:%d" % worker.port, "x")
+    assert reply.startswith(b"-ERR"), reply
+    reply = c.call("rpc", "repeat", "1000", "127.0.0.1:%d" % worker.port,
+                   "repeat-ok")
+    assert reply.startswith(b"+OK"), reply
+    tid = reply.split(b":")[1].strip()
+    assert c.call("del", tid).startswith(b"+"), "del failed"
+
+
+def test_empty_multibulk(worker):
+    """*0 and *-1 are skipped like in Redis, the connection goes on."""
+    c = Client()
+    reply = c.send(b"*0\r\n*-1\r\n" +
+                   encode("rpc", "once", "0", "127.0.0.1:%d" % worker.port,
+                          "after-empty"))
+    assert reply.startswith(b"+OK"), reply
+    assert worker.wait_for(b"after-empty"), "message not delivered"
+
+
+TESTS = [test_hostname_endpoint_due_now, test_repeat_interval_zero,
+         test_empty_multibulk]
+
+
+def main():
+    worker = Worker()
+    proc = start_server()
+    failed = 0
+    try:
+        for test in TESTS:
+            try:
+                test(worker)
+                print("[ok] %s" % test.__name__)
+            except Exception as e:
+                failed += 1
+                print("[err] %s: %r" % (test.__name__, e))
+    finally:
+        proc.terminate()
+        proc.wait()
+    print("%d tests, %d failed" % (len(TESTS), failed))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,127 @@
+/* Time event store benchmark.
+ *
+ * Compares the skiplist and the timing wheel used by ae.c for pending time
+ * events: insert N timers spread over one hour, cancel 10% of them, then
+ * advance the clock millisecond by millisecond until every timer fired.
+ *
+ * Usage: ./timer-benchmark [pending timers ...]
+ * Default sizes are 1M, 10M and 50M (50M needs several GB of memory). */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "skiplist.h"
+#include "timewheel.h"
+#include "zmalloc.h"
+
+#define BENCH_SPAN (60 * 60 * 1000) /* timers fire within one hour */
+#define BENCH_BASE 1460000000000LL
+
+static long long
+ustime(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void
+report(const char* store, const char* op, long long n, long long us)
+{
+    printf("%-9s %-8s %10lld ops %8.3f s %8.1f ns/op\n", store, op, n,
+           us / 1e6, n ? us * 1000.0 / n : 0);
+}
+
+static void
+benchSkiplist(long long n, long long* when)
+{
+    skiplist* sl = createSkiplist();
+    size_t mem = zmalloc_used_memory();
+    long long i, t, start, fired = 0;
+
+    start = ustime();
+    for (i = 0; i < n; i++)
+        skiplistInsert(sl, when[i], NULL, i);
+    report("skiplist", "insert", n, ustime() - start);
+    printf("skiplist  %.1f bytes per pending timer\n",
+           (double)(zmalloc_used_memory() - mem) / n);
+
+    start = ustime();
+    for (i = 0; i < n; i += 10)
+        skiplistDelete(sl, when[i], i);
+    report("skiplist", "cancel", n / 10, ustime() - start);
+
+    start = ustime();
+    for (t = BENCH_BASE; t <= BENCH_BASE + BENCH_SPAN; t++) {
+        skiplistNode* x;
+
+        while ((x = sl->header->level[0].forward) && x->score <= t) {
+            skiplistDelete(sl, x->score, x->id);
+            fired++;
+        }
+    }
+    report("skiplist", "expire", fired, ustime() - start);
+    freeSkiplist(sl);
+}
+
+static void
+benchWheel(long long n, long long* when)
+{
+    timeWheel* tw = createTimeWheel(BENCH_BASE);
+    size_t mem = zmalloc_used_memory();
+    long long i, t, start, fired = 0;
+
+    start = ustime();
+    for (i = 0; i < n; i++)
+        timeWheelInsert(tw, when[i], NULL, i);
+    report("wheel", "insert", n, ustime() - start);
+    printf("wheel     %.1f bytes per pending timer\n",
+           (double)(zmalloc_used_memory() - mem) / n);
+
+    start = ustime();
+    for (i = 0; i < n; i += 10)
+        timeWheelDelete(tw, i);
+    report("wheel", "cancel", n / 10, ustime() - start);
+
+    start = ustime();
+    for (t = BENCH_BASE; t <= BENCH_BASE + BENCH_SPAN; t++) {
+        timeWheelExpire(tw, t);
+        while (tw->expired) {
+            timeWheelDelete(tw, tw->expired->id);
+            fired++;
+        }
+    }
+    report("wheel", "expire", fired, ustime() - start);
+    freeTimeWheel(tw);
+}
+
+int
+main(int argc, char** argv)
+{
+    long long defaults[] = { 1000000, 10000000, 50000000 };
+    int nsizes = argc > 1 ? argc - 1 : 3;
+    int j;
+
+    srandom(1234);
+    for (j = 0; j < nsizes; j++) {
+        long long n = argc > 1 ? atoll(argv[j + 1]) : defaults[j], i;
+        long long* when = malloc(sizeof(long long) * n);
+
+        if (n <= 0 || when == NULL) {
+            fprintf(stderr, "Can't run with %lld timers\n", n);
+            return 1;
+        }
+        for (i = 0; i < n; i++)
+            when[i] = BENCH_BASE + 1 + random() % BENCH_SPAN;
+
+        printf("== %lld pending timers\n", n);
+        benchSkiplist(n, when);
+        benchWheel(n, when);
+        free(when);
+    }
+    return 0;
+}
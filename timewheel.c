@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include "timewheel.h"
+#include "pool.h"
+#include "zmalloc.h"
+
+static __thread objPool timeWheelNodePool =
+  POOL_STATIC_INIT(sizeof(timeWheelNode));
+
+static const int twSlots[TW_LEVELS] = { 1000, 60, 60, 24, TW_DAYS };
+static const long long twUnit[TW_LEVELS] = { 1, 1000, 60 * 1000,
+                                             60 * 60 * 1000,
+                                             24 * 60 * 60 * 1000 };
+
+timeWheel*
+createTimeWheel(long long now)
+{
+    timeWheel* tw = zmalloc(sizeof(*tw));
+    int i, j;
+
+    for (i = 0; i < TW_LEVELS; i++) {
+        tw->slots[i] = zmalloc(sizeof(timeWheelNode*) * twSlots[i]);
+        for (j = 0; j < twSlots[i]; j++)
+            tw->slots[i][j] = NULL;
+        for (j = 0; j < TW_BITMAP_WORDS; j++)
+            tw->bitmap[i][j] = 0;
+        tw->count[i] = 0;
+    }
+    tw->overflow = NULL;
+    tw->expired = tw->expiredtail = NULL;
+    tw->nexpired = 0;
+    tw->current = now;
+    tw->length = 0;
+    tw->ids = intMapCreate();
+    return tw;
+}
+
+void
+freeTimeWheel(timeWheel* tw)
+{
+    unsigned long j;
+    int i;
+
+    for (j = 0; j < tw->ids->size; j++) {
+        if (tw->ids->table[j].val)
+            poolFree(&timeWheelNodePool, tw->ids->table[j].val);
+    }
+    intMapRelease(tw->ids);
+    for (i = 0; i < TW_LEVELS; i++)
+        zfree(tw->slots[i]);
+    zfree(tw);
+}
+
+static timeWheelNode**
+twListHead(timeWheel* tw, int level, int slot)
+{
+    if (level == TW_EXPIRED) return &tw->expired;
+    if (level == TW_OVERFLOW) return &tw->overflow;
+    return &tw->slots[level][slot];
+}
+
+static void
+twLink(timeWheel* tw, timeWheelNode* node, int level, int slot)
+{
+    node->level = level;
+    node->slot = slot;
+    node->prev = NULL;
+    if (level == TW_EXPIRED) {
+        /* The expired list is FIFO so timers fire in deadline order. */
+        node->next = NULL;
+        node->prev = tw->expiredtail;
+        if (tw->expiredtail)
+            tw->expiredtail->next = node;
+        else
+            tw->expired = node;
+        tw->expiredtail = node;
+        tw->nexpired++;
+        return;
+    }
+
+    timeWheelNode** head = twListHead(tw, level, slot);
+    node->next = *head;
+    if (*head) (*head)->prev = node;
+    *head = node;
+    if (level != TW_OVERFLOW) {
+        tw->bitmap[level][slot / 64] |= 1ULL << (slot % 64);
+        tw->count[level]++;
+    }
+}
+
+static void
+twUnlink(timeWheel* tw, timeWheelNode* node)
+{
+    timeWheelNode** head = twListHead(tw, node->level, node->slot);
+
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        *head = node->next;
+    if (node->next) node->next->prev = node->prev;
+
+    if (node->level == TW_EXPIRED) {
+        if (tw->expiredtail == node) tw->expiredtail = node->prev;
+        tw->nexpired--;
+    } else if (node->level != TW_OVERFLOW) {
+        if (*head == NULL)
+            tw->bitmap[node->level][node->slot / 64] &=
+              ~(1ULL << (node->slot % 64));
+        tw->count[node->level]--;
+    }
+}
+
+/* Put the node in the lowest level whose current bucket of the level above
+ * contains its deadline. */
+static void
+twPlace(timeWheel* tw, timeWheelNode* node)
+{
+    long long when = node->when;
+    int level;
+
+    if (when <= tw->current) {
+        twLink(tw, node, TW_EXPIRED, 0);
+        return;
+    }
+    for (level = 0; level < TW_LEVELS - 1; level++) {
+        if (when / twUnit[level + 1] == tw->current / twUnit[level + 1]) break;
+    }
+    if (level == TW_LEVELS - 1 &&
+        when / twUnit[level] - tw->current / twUnit[level] >= TW_DAYS) {
+        twLink(tw, node, TW_OVERFLOW, 0);
+        return;
+    }
+    twLink(tw, node, level,
+           (int)((when / twUnit[level]) % twSlots[level]));
+}
+
+timeWheelNode*
+timeWheelInsert(timeWheel* tw, long long when, void* obj, long long id)
+{
+    timeWheelNode* node = poolAlloc(&timeWheelNodePool);
+
+    node->obj = obj;
+    node->when = when;
+    node->id = id;
+    twPlace(tw, node);
+    intMapAdd(tw->ids, id, node);
+    tw->length++;
+    return node;
+}
+
+/* Remove the timer with the given id. Returns the object it carried, or
+ * NULL if there is no such timer. */
+void*
+timeWheelDelete(timeWheel* tw, long long id)
+{
+    timeWheelNode* node = intMapDelete(tw->ids, id);
+    void* obj;
+
+    if (!node) return NULL;
+    obj = node->obj;
+    twUnlink(tw, node);
+    poolFree(&timeWheelNodePool, node);
+    tw->length--;
+    return obj;
+}
+
+void
+timeWheelReschedule(timeWheel* tw, timeWheelNode* node, long long when)
+{
+    twUnlink(tw, node);
+    node->when = when;
+    twPlace(tw, node);
+}
+
+/* Move every node of a slot (or of the overflow list) one level down. */
+static void
+twCascade(timeWheel* tw, int level, int slot)
+{
+    timeWheelNode** head = twListHead(tw, level, slot);
+    timeWheelNode *node = *head, *next;
+
+    /* Detach the whole list first, overflow nodes may land right back in
+     * the overflow list. */
+    *head = NULL;
+    if (level != TW_OVERFLOW)
+        tw->bitmap[level][slot / 64] &= ~(1ULL << (slot % 64));
+    while (node) {
+        next = node->next;
+        if (level != TW_OVERFLOW) tw->count[level]--;
+        twPlace(tw, node);
+        node = next;
+    }
+}
+
+/* Advance the wheel to 'now', moving every timer whose deadline is <= now
+ * to the expired list. Ranges with no timers are skipped in one step. */
+void
+timeWheelExpire(timeWheel* tw, long long now)
+{
+    while (tw->current < now) {
+        long long next = tw->current, t;
+        int level;
+
+        for (level = 0; level < TW_LEVELS && tw->count[level] == 0; level++)
+            ;
+        if (level > 0) {
+            /* Nothing can fire before the next cascade of 'level'. The
+             * overflow list is cascaded together with the day level. */
+            if (level == TW_LEVELS && tw->overflow == NULL) {
+                next = now;
+            } else {
+                long long unit = twUnit[level < TW_LEVELS ? level : level - 1];
+                next = (tw->current / unit + 1) * unit - 1;
+            }
+            if (next > now) next = now;
+        }
+        if (next > tw->current) {
+            tw->current = next;
+            continue;
+        }
+
+        t = ++tw->current;
+        if (t % twUnit[1] == 0) {
+            if (t % twUnit[2] == 0) {
+                if (t % twUnit[3] == 0) {
+                    if (t % twUnit[4] == 0) {
+                        twCascade(tw, TW_OVERFLOW, 0);
+                        twCascade(tw, 4, (int)((t / twUnit[4]) % twSlots[4]));
+                    }
+                    twCascade(tw, 3, (int)((t / twUnit[3]) % twSlots[3]));
+                }
+                twCascade(tw, 2, (int)((t / twUnit[2]) % twSlots[2]));
+            }
+            twCascade(tw, 1, (int)((t / twUnit[1]) % twSlots[1]));
+        }
+        twCascade(tw, 0, (int)(t % twSlots[0]));
+    }
+}
+
+/* Return the index of the first non empty slot in [from, to), or -1. */
+static int
+twNextSlot(timeWheel* tw, int level, int from, int to)
+{
+    int i = from;
+
+    while (i < to) {
+        uint64_t word = tw->bitmap[level][i / 64] >> (i % 64);
+        if (word) {
+            i += __builtin_ctzll(word);
+            return i < to ? i : -1;
+        }
+        i = (i / 64 + 1) * 64;
+    }
+    return -1;
+}
+
+/* Return a deadline no later than the nearest timer, or -1 if the wheel is
+ * empty. Timers in level 0 give an exact answer, higher levels return the
+ * time their slot will be cascaded. */
+long long
+timeWheelNearest(timeWheel* tw)
+{
+    int level, cur, slot;
+
+    if (tw->expired) return tw->current;
+    for (level = 0; level < TW_LEVELS; level++) {
+        long long unit = twUnit[level];
+
+        if (tw->count[level] == 0) continue;
+        cur = (int)((tw->current / unit) % twSlots[level]);
+        if (level < TW_LEVELS - 1) {
+            slot = twNextSlot(tw, level, cur + 1, twSlots[level]);
+            if (slot != -1)
+                return (tw->current / unit - cur + slot) * unit;
+        } else {
+            /* The day level wraps around. */
+            slot = twNextSlot(tw, level, cur + 1, twSlots[level]);
+            if (slot != -1) return (tw->current / unit - cur + slot) * unit;
+            slot = twNextSlot(tw, level, 0, cur + 1);
+            if (slot != -1)
+                return (tw->current / unit - cur + slot + TW_DAYS) * unit;
+        }
+    }
+    if (tw->overflow) return (tw->current / twUnit[4] + 1) * twUnit[4];
+    return -1;
+}
@@ -0,0 +1,55 @@
+#ifndef __TIMEWHEEL_H__
+#define __TIMEWHEEL_H__
+
+#include <stdint.h>
+
+#include "intmap.h"
+
+/* Hashed hierarchical timing wheel with millisecond resolution.
+ *
+ * Level 0 has one slot per millisecond of the current second, level 1 one
+ * slot per second of the current minute, then minutes of the hour, hours of
+ * the day and days. Timers further than TW_DAYS days away wait in an
+ * overflow list that is re-examined at every day boundary. */
+#define TW_LEVELS 5
+#define TW_DAYS 64
+#define TW_MAX_SLOTS 1000
+#define TW_BITMAP_WORDS ((TW_MAX_SLOTS + 63) / 64)
+
+#define TW_EXPIRED -1        /* node is due and waits to be fired */
+#define TW_OVERFLOW TW_LEVELS /* node is beyond the last level */
+
+typedef struct timeWheelNode
+{
+    void* obj;
+    long long when; /* absolute fire time in milliseconds */
+    long long id;
+    int level;
+    int slot;
+    struct timeWheelNode* prev;
+    struct timeWheelNode* next;
+} timeWheelNode;
+
+typedef struct timeWheel
+{
+    timeWheelNode** slots[TW_LEVELS];
+    uint64_t bitmap[TW_LEVELS][TW_BITMAP_WORDS]; /* non empty slots */
+    unsigned long count[TW_LEVELS];              /* nodes per level */
+    timeWheelNode* overflow;
+    timeWheelNode* expired;
+    timeWheelNode* expiredtail;
+    unsigned long nexpired;
+    long long current; /* last millisecond the wheel advanced to */
+    unsigned long length;
+    intMap* ids; /* id -> timeWheelNode, for O(1) delete */
+} timeWheel;
+
+timeWheel* createTimeWheel(long long now);
+void freeTimeWheel(timeWheel* tw);
+timeWheelNode* timeWheelInsert(timeWheel* tw, long long when, void* obj,
+                               long long id);
+void* timeWheelDelete(timeWheel* tw, long long id);
+void timeWheelReschedule(timeWheel* tw, timeWheelNode* node, long long when);
+void timeWheelExpire(timeWheel* tw, long long now);
+long long timeWheelNearest(timeWheel* tw);
+#endif
@@ -0,0 +1,545 @@
+/* Worker dispatch.
+ *
+ * When a task fires its message is delivered to the worker listening on
+ * addr:port. Nothing here is allowed to block the event loop: the connect
+ * is non blocking and the payload is written from the event loop, so a
+ * slow or unreachable worker only delays its own messages.
+ *
+ * Connections are pooled per endpoint and kept open between firings, so the
+ * per-fire cost is a copy of the message into the connection output buffer.
+ * Every message queued during one event loop iteration is flushed from
+ * beforeSleep with a single write per connection, and a writable handler is
+ * only installed when the socket can't take everything. Idle connections
+ * are closed by workerPoolCron, and an endpoint that keeps failing is marked
+ * down for a while instead of being hammered with connects.
+ *
+ * Each shard interns the endpoints its tasks were submitted for: the
+ * address is parsed once and resolved when interned, and tasks only keep
+ * the 32 bit endpoint id. A host name is looked up by a short lived thread
+ * so that a slow resolver never stalls the loop, messages fired before the
+ * lookup completed wait in the endpoint and go out once it did. The name is
+ * looked up again whenever the endpoint is marked down, the old address is
+ * used until then.
+ *
+ * Endpoints keep histograms of their connect times, of the time messages
+ * wait until written and of the output queued ahead of them, reported by
+ * LATENCY ENDPOINTS. */
+
+#include "server.h"
+
+#include <sys/socket.h>
+
+/* Written bytes are only moved out of the output buffer once there are this
+ * many of them, or when the whole buffer went out. */
+#define WORKER_OUTBUF_COMPACT (64 * 1024)
+
+static void workerWriteHandler(aeEventLoop* el, int fd, void* privdata,
+                               int mask);
+static void workerReadHandler(aeEventLoop* el, int fd, void* privdata,
+                              int mask);
+
+/* Pools are keyed by the "addr:port" string object, so that the rpc
+ * argument view can be looked up as it is. */
+dictType workerPoolDictType = { dictObjHash,
+                                NULL,
+                                NULL,
+                                dictObjKeyCompare,
+                                dictRedisObjectDestructor,
+                                NULL };
+
+static workerPool*
+createWorkerPool(char* addr, size_t addrlen, int port)
+{
+    workerPool* pool = zmalloc(sizeof(*pool));
+
+    pool->addr = sdsnewlen(addr, addrlen);
+    pool->port = port;
+    pool->resolved = 0;
+    pool->resolving = 0;
+    pool->lookupqueue = listCreate();
+    listSetFreeMethod(pool->lookupqueue, (void (*)(void*))sdsfree);
+    pool->lookupbytes = 0;
+    pool->conns = listCreate();
+    pool->failures = 0;
+    pool->downuntil = 0;
+    histogramReset(&pool->stat_connect);
+    histogramReset(&pool->stat_write);
+    histogramReset(&pool->stat_queuedepth);
+    return pool;
+}
+
+typedef struct workerLookup {
+    taskShard* shard;
+    workerPool* pool;
+} workerLookup;
+
+static void*
+workerLookupThread(void* arg)
+{
+    workerLookup* lookup = arg;
+    workerPool* pool = lookup->pool;
+    shardMessage m = { .type = SHARD_MSG_RESOLVED };
+
+    m.id = pool->id;
+    m.result = anetTcpResolve(pool->lookuperr, pool->addr, pool->port,
+                              &pool->lookupsa, 0);
+    postShardMessage(lookup->shard, &m);
+    zfree(lookup);
+    return NULL;
+}
+
+/* Resolve the address of 'pool'. A dotted quad is parsed right away, a host
+ * name is handed to a lookup thread unless one is running already. */
+static void
+resolveWorkerPool(workerPool* pool)
+{
+    workerLookup* lookup;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int err;
+
+    if (pool->resolving) return;
+    if (anetTcpResolve(NULL, pool->addr, pool->port, &pool->sa,
+                       ANET_IP_ONLY) == ANET_OK) {
+        pool->resolved = 1;
+        return;
+    }
+
+    lookup = zmalloc(sizeof(*lookup));
+    lookup->shard = myshard;
+    lookup->pool = pool;
+    pool->resolving = 1;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((err = pthread_create(&thread, &attr, workerLookupThread, lookup))) {
+        redisLog(REDIS_WARNING, "Can't look up worker %s:%d: %s", pool->addr,
+                 pool->port, strerror(err));
+        pool->resolving = 0;
+        zfree(lookup);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* Called in the shard thread on SHARD_MSG_RESOLVED. The messages queued
+ * during the lookup are dispatched, or dropped if it failed. A failed lookup
+ * marks the endpoint down, it is looked up again by the next dispatch
+ * after. */
+void
+workerPoolResolved(uint32_t endpoint, int result)
+{
+    workerPool* pool = myshard->endpoints[endpoint];
+    listNode* ln;
+
+    pool->resolving = 0;
+    if (result == ANET_ERR) {
+        redisLog(REDIS_WARNING, "Resolving worker %s:%d (%lu messages "
+                 "dropped): %s", pool->addr, pool->port,
+                 (unsigned long)listLength(pool->lookupqueue),
+                 pool->lookuperr);
+        pool->downuntil = time(NULL) + WORKER_POOL_DOWN_TIME;
+    } else {
+        pool->sa = pool->lookupsa;
+        pool->resolved = 1;
+    }
+
+    while ((ln = listFirst(pool->lookupqueue)) != NULL) {
+        sds msg = listNodeValue(ln);
+
+        if (!pool->resolved ||
+            dispatchToWorker(endpoint, msg, sdslen(msg)) == REDIS_ERR)
+            myshard->stat_dispatch_failed++;
+        listDelNode(pool->lookupqueue, ln);
+    }
+    pool->lookupbytes = 0;
+}
+
+/* Set *id to the endpoint of 'addr', an "addr:port" string, interning it
+ * the first time it is seen. Endpoints live as long as their shard.
+ * Returns REDIS_ERR if 'addr' is not a valid endpoint. */
+int
+internWorkerEndpoint(robj* addr, uint32_t* id)
+{
+    taskShard* s = myshard;
+    size_t len = stringObjectLen(addr);
+    char *host = addr->ptr, *split, *eptr;
+    workerPool* pool;
+    dictEntry* de;
+    long port;
+
+    if ((de = dictFind(s->workers, addr)) != NULL) {
+        *id = ((workerPool*)dictGetEntryVal(de))->id;
+        return REDIS_OK;
+    }
+
+    if ((split = memchr(host, ':', len)) == NULL || split == host)
+        return REDIS_ERR;
+    errno = 0;
+    port = strtol(split + 1, &eptr, 10);
+    if (errno || eptr != host + len || eptr == split + 1 || port < 1 ||
+        port > 65535)
+        return REDIS_ERR;
+
+    pool = createWorkerPool(host, split - host, (int)port);
+    pthread_mutex_lock(&s->endpointslock);
+    if (s->nendpoints == s->endpointscap) {
+        s->endpointscap = s->endpointscap ? s->endpointscap * 2 : 16;
+        s->endpoints =
+          zrealloc(s->endpoints, sizeof(workerPool*) * s->endpointscap);
+    }
+    pool->id = s->nendpoints++;
+    s->endpoints[pool->id] = pool;
+    pthread_mutex_unlock(&s->endpointslock);
+    dictAdd(s->workers, createObject(REDIS_STRING, sdsnewlen(host, len)),
+            pool);
+    resolveWorkerPool(pool);
+    *id = pool->id;
+    return REDIS_OK;
+}
+
+/* Account a failed connect or write against the endpoint. Once it failed
+ * too many times in a row it is marked down for a while, and its address
+ * is resolved again in the meantime. */
+static void
+workerPoolFailure(workerPool* pool)
+{
+    if (++pool->failures < WORKER_POOL_MAX_FAILURES) return;
+    pool->downuntil = time(NULL) + WORKER_POOL_DOWN_TIME;
+    resolveWorkerPool(pool);
+    redisLog(REDIS_WARNING, "Worker %s:%d marked down for %d seconds",
+             pool->addr, pool->port, WORKER_POOL_DOWN_TIME);
+}
+
+static workerConn*
+createWorkerConn(workerPool* pool)
+{
+    char err[ANET_ERR_LEN];
+    workerConn* wc;
+    int fd;
+
+    if ((fd = anetTcpNonBlockConnectAddr(err, &pool->sa)) == ANET_ERR) {
+        redisLog(REDIS_WARNING, "Connecting to worker %s:%d: %s", pool->addr,
+                 pool->port, err);
+        return NULL;
+    }
+    anetTcpNoDelay(NULL, fd);
+
+    wc = zmalloc(sizeof(*wc));
+    wc->fd = fd;
+    wc->state = WORKER_CONNECTING;
+    wc->pool = pool;
+    wc->outbuf = sdsempty();
+    wc->sentlen = 0;
+    wc->flushqueued = 0;
+    wc->lastinteraction = time(NULL);
+    wc->connectstart = getMonotonicUs();
+    wc->queuedbytes = 0;
+    wc->writtenbytes = 0;
+    wc->markfirst = 0;
+    wc->nmarks = 0;
+
+    /* The read handler only exists to notice when the worker hangs up, so
+     * that a dead connection is not picked for the next dispatch. The
+     * writable handler tells us when the connect completed. */
+    if (aeCreateFileEvent(myshard->el, fd, AE_READABLE, workerReadHandler,
+                          wc) == AE_ERR ||
+        aeCreateFileEvent(myshard->el, fd, AE_WRITABLE, workerWriteHandler,
+                          wc) == AE_ERR) {
+        aeDeleteFileEvent(myshard->el, fd, AE_READABLE | AE_WRITABLE);
+        close(fd);
+        sdsfree(wc->outbuf);
+        zfree(wc);
+        return NULL;
+    }
+    listAddNodeTail(pool->conns, wc);
+    return wc;
+}
+
+static void
+freeWorkerConn(workerConn* wc)
+{
+    listNode* ln = listSearchKey(wc->pool->conns, wc);
+
+    if (ln) listDelNode(wc->pool->conns, ln);
+    if (wc->flushqueued) {
+        ln = listSearchKey(myshard->worker_flush, wc);
+        listDelNode(myshard->worker_flush, ln);
+    }
+    aeDeleteFileEvent(myshard->el, wc->fd, AE_READABLE | AE_WRITABLE);
+    close(wc->fd);
+    sdsfree(wc->outbuf);
+    zfree(wc);
+}
+
+/* Account a failure against the endpoint and drop the connection. Whatever
+ * was still queued on it is lost. */
+static void
+failWorkerConn(workerConn* wc)
+{
+    workerPool* pool = wc->pool;
+
+    wc->state = WORKER_FAILED;
+    myshard->stat_worker_errors++;
+    redisLog(REDIS_VERBOSE, "Dispatch to worker %s:%d failed: %s", pool->addr,
+             pool->port, strerror(errno));
+    if (sdslen(wc->outbuf) > wc->sentlen)
+        redisLog(REDIS_WARNING,
+                 "Dropped %zu bytes of messages queued for worker %s:%d",
+                 sdslen(wc->outbuf) - wc->sentlen, pool->addr, pool->port);
+    workerPoolFailure(pool);
+    freeWorkerConn(wc);
+}
+
+static void
+workerReadHandler(aeEventLoop* el, int fd, void* privdata, int mask)
+{
+    UNUSED(el);
+    UNUSED(mask);
+    workerConn* wc = privdata;
+    char buf[REDIS_IOBUF_LEN];
+    int nread;
+
+    /* Workers are not expected to answer, anything they send is dropped. */
+    nread = read(fd, buf, sizeof(buf));
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread > 0) return;
+    if (nread == 0) {
+        redisLog(REDIS_VERBOSE, "Worker %s:%d closed connection",
+                 wc->pool->addr, wc->pool->port);
+        if (sdslen(wc->outbuf) == wc->sentlen) {
+            freeWorkerConn(wc);
+            return;
+        }
+    }
+    failWorkerConn(wc);
+}
+
+/* Account the write completion of the timed messages the socket took. */
+static void
+recordWrittenMessages(workerConn* wc)
+{
+    monotime now;
+
+    if (wc->nmarks == 0 || wc->marks[wc->markfirst].end > wc->writtenbytes)
+        return;
+    now = getMonotonicUs();
+    while (wc->nmarks && wc->marks[wc->markfirst].end <= wc->writtenbytes) {
+        histogramRecord(&wc->pool->stat_write,
+                        now - wc->marks[wc->markfirst].queued);
+        wc->markfirst = (wc->markfirst + 1) % WORKER_WRITE_MARKS;
+        wc->nmarks--;
+    }
+}
+
+/* Write as much of the output buffer as the socket takes. Returns
+ * REDIS_ERR if the connection was dropped. */
+static int
+writeWorkerConn(workerConn* wc)
+{
+    size_t len = sdslen(wc->outbuf);
+
+    while (wc->sentlen < len) {
+        ssize_t nwritten = write(wc->fd, wc->outbuf + wc->sentlen,
+                                 len - wc->sentlen);
+
+        if (nwritten == -1) {
+            if (errno == EAGAIN) break;
+            failWorkerConn(wc);
+            return REDIS_ERR;
+        }
+        wc->sentlen += nwritten;
+        wc->writtenbytes += nwritten;
+    }
+    recordWrittenMessages(wc);
+
+    if (wc->sentlen == len) {
+        /* Don't keep a buffer sized for a burst around. */
+        if (sdsavail(wc->outbuf) + len > WORKER_OUTBUF_COMPACT) {
+            sdsfree(wc->outbuf);
+            wc->outbuf = sdsempty();
+        } else {
+            wc->outbuf = sdsrange(wc->outbuf, len, -1);
+        }
+        wc->sentlen = 0;
+    } else if (wc->sentlen >= WORKER_OUTBUF_COMPACT) {
+        wc->outbuf = sdsrange(wc->outbuf, wc->sentlen, -1);
+        wc->sentlen = 0;
+    }
+    return REDIS_OK;
+}
+
+/* Flush the output queue. If the socket can't take all of it wait for it
+ * to become writable, otherwise the connection goes back to idle. */
+static void
+flushWorkerConn(workerConn* wc)
+{
+    if (writeWorkerConn(wc) == REDIS_ERR) return;
+
+    if (sdslen(wc->outbuf) > wc->sentlen) {
+        if (wc->state != WORKER_WRITING) {
+            if (aeCreateFileEvent(myshard->el, wc->fd, AE_WRITABLE,
+                                  workerWriteHandler, wc) == AE_ERR) {
+                failWorkerConn(wc);
+                return;
+            }
+            wc->state = WORKER_WRITING;
+        }
+        return;
+    }
+    if (wc->state == WORKER_WRITING)
+        aeDeleteFileEvent(myshard->el, wc->fd, AE_WRITABLE);
+    wc->state = WORKER_IDLE;
+    wc->lastinteraction = time(NULL);
+    wc->pool->failures = 0;
+}
+
+static void
+workerWriteHandler(aeEventLoop* el, int fd, void* privdata, int mask)
+{
+    UNUSED(el);
+    UNUSED(mask);
+    workerConn* wc = privdata;
+
+    if (wc->state == WORKER_CONNECTING) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1)
+            err = errno;
+        if (err) {
+            errno = err;
+            failWorkerConn(wc);
+            return;
+        }
+        histogramRecord(&wc->pool->stat_connect,
+                        getMonotonicUs() - wc->connectstart);
+        wc->state = WORKER_WRITING;
+    }
+    flushWorkerConn(wc);
+}
+
+/* Pick the connection that will carry the next message. A connection that
+ * is connected and not blocked is preferred, so that all the messages for
+ * an endpoint fired in the same iteration go out with a single writev.
+ * Otherwise a new one is opened while the pool is below worker_max_conns,
+ * and as a last resort the one with the least pending output is used. */
+static workerConn*
+getWorkerConn(workerPool* pool)
+{
+    workerConn *wc, *best = NULL;
+    listIter li;
+    listNode* ln;
+
+    listRewind(pool->conns, &li);
+    while ((ln = listNext(&li))) {
+        wc = listNodeValue(ln);
+        if (wc->state == WORKER_IDLE) return wc;
+        if (!best || sdslen(wc->outbuf) - wc->sentlen <
+                       sdslen(best->outbuf) - best->sentlen)
+            best = wc;
+    }
+    if ((int)listLength(pool->conns) < server.worker_max_conns) {
+        if ((wc = createWorkerConn(pool)) != NULL) return wc;
+        workerPoolFailure(pool);
+    }
+    return best;
+}
+
+/* Queue the 'len' bytes at 'msg' for the worker of 'endpoint'. The message
+ * is copied to a pooled connection and written before the event loop
+ * sleeps again, so the caller may free it right away. */
+int
+dispatchToWorker(uint32_t endpoint, const char* msg, size_t len)
+{
+    workerPool* pool = myshard->endpoints[endpoint];
+    workerConn* wc;
+
+    if (pool->downuntil > time(NULL)) {
+        redisLog(REDIS_VERBOSE, "Worker %s:%d is down, message dropped",
+                 pool->addr, pool->port);
+        return REDIS_ERR;
+    }
+    if (!pool->resolved) resolveWorkerPool(pool);
+    if (!pool->resolved) {
+        /* Held until the lookup completes, see workerPoolResolved(). */
+        if (!pool->resolving ||
+            pool->lookupbytes + len > WORKER_LOOKUP_QUEUE_MAX) {
+            redisLog(REDIS_VERBOSE, "Worker %s:%d not resolved, message "
+                     "dropped", pool->addr, pool->port);
+            return REDIS_ERR;
+        }
+        listAddNodeTail(pool->lookupqueue, sdsnewlen(msg, len));
+        pool->lookupbytes += len;
+        return REDIS_OK;
+    }
+    if ((wc = getWorkerConn(pool)) == NULL) return REDIS_ERR;
+
+    /* Connected but not reading: stop piling messages up in memory. The
+     * connection picked has the least output pending, so the others are
+     * stuck too. */
+    if (sdslen(wc->outbuf) - wc->sentlen + len > WORKER_OUTBUF_MAX) {
+        pool->downuntil = time(NULL) + WORKER_POOL_DOWN_TIME;
+        redisLog(REDIS_WARNING, "Worker %s:%d is not reading, marked down "
+                 "for %d seconds", pool->addr, pool->port,
+                 WORKER_POOL_DOWN_TIME);
+        return REDIS_ERR;
+    }
+
+    histogramRecord(&pool->stat_queuedepth, sdslen(wc->outbuf) - wc->sentlen);
+    wc->outbuf = sdscatlen(wc->outbuf, (void*)msg, len);
+    wc->queuedbytes += len;
+    if (wc->nmarks < WORKER_WRITE_MARKS) {
+        int j = (wc->markfirst + wc->nmarks++) % WORKER_WRITE_MARKS;
+
+        wc->marks[j].end = wc->queuedbytes;
+        wc->marks[j].queued = getMonotonicUs();
+    }
+    if (wc->state == WORKER_IDLE && !wc->flushqueued) {
+        wc->flushqueued = 1;
+        listAddNodeTail(myshard->worker_flush, wc);
+    }
+    return REDIS_OK;
+}
+
+/* Write the messages queued since the last call. Called before sleeping. */
+void
+flushWorkerConns(void)
+{
+    listNode* ln;
+
+    while ((ln = listFirst(myshard->worker_flush)) != NULL) {
+        workerConn* wc = listNodeValue(ln);
+
+        listDelNode(myshard->worker_flush, ln);
+        wc->flushqueued = 0;
+        if (wc->state == WORKER_IDLE) flushWorkerConn(wc);
+    }
+}
+
+/* Close connections that have been idle for more than worker_idle_timeout
+ * seconds. Called about once per second. */
+void
+workerPoolCron(void)
+{
+    time_t now = time(NULL);
+    dictIterator* di;
+    dictEntry* de;
+
+    di = dictGetIterator(myshard->workers);
+    while ((de = dictNext(di)) != NULL) {
+        workerPool* pool = dictGetEntryVal(de);
+        listIter li;
+        listNode* ln;
+
+        listRewind(pool->conns, &li);
+        while ((ln = listNext(&li))) {
+            workerConn* wc = listNodeValue(ln);
+            if (wc->state == WORKER_IDLE && sdslen(wc->outbuf) == 0 &&
+                now - wc->lastinteraction > server.worker_idle_timeout) {
+                redisLog(REDIS_VERBOSE, "Closing idle connection to %s:%d",
+                         pool->addr, pool->port);
+                freeWorkerConn(wc);
+            }
+        }
+    }
+    dictReleaseIterator(di);
+}
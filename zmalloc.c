@@ -40,11 +40,30 @@
 #define PREFIX_SIZE sizeof(size_t)
 #endif
 
+/* With several threads allocating, the counter is updated with an atomic
+ * add when the compiler has one, so that zmalloc does not serialize them on
+ * a mutex. */
+#if defined(__ATOMIC_RELAXED)
+#define update_used_memory_ts(_n) \
+    __atomic_add_fetch(&used_memory, (_n), __ATOMIC_RELAXED)
+#define read_used_memory_ts(_um) \
+    ((_um) = __atomic_load_n(&used_memory, __ATOMIC_RELAXED))
+#else
+#define update_used_memory_ts(_n) do { \
+    pthread_mutex_lock(&used_memory_mutex);  \
+    used_memory += (_n); \
+    pthread_mutex_unlock(&used_memory_mutex); \
+} while(0)
+#define read_used_memory_ts(_um) do { \
+    pthread_mutex_lock(&used_memory_mutex);  \
+    (_um) = used_memory; \
+    pthread_mutex_unlock(&used_memory_mutex); \
+} while(0)
+#endif
+
 #define increment_used_memory(_n) do { \
     if (zmalloc_thread_safe) { \
-        pthread_mutex_lock(&used_memory_mutex);  \
-        used_memory += _n; \
-        pthread_mutex_unlock(&used_memory_mutex); \
+        update_used_memory_ts(_n); \
     } else { \
         used_memory += _n; \
     } \
@@ -52,9 +71,7 @@
 
 #define decrement_used_memory(_n) do { \
     if (zmalloc_thread_safe) { \
-        pthread_mutex_lock(&used_memory_mutex);  \
-        used_memory -= _n; \
-        pthread_mutex_unlock(&used_memory_mutex); \
+        update_used_memory_ts(-(_n)); \
     } else { \
         used_memory -= _n; \
     } \
@@ -143,9 +160,10 @@ char *zstrdup(const char *s) {
 size_t zmalloc_used_memory(void) {
     size_t um;
 
-    if (zmalloc_thread_safe) pthread_mutex_lock(&used_memory_mutex);
-    um = used_memory;
-    if (zmalloc_thread_safe) pthread_mutex_unlock(&used_memory_mutex);
+    if (zmalloc_thread_safe)
+        read_used_memory_ts(um);
+    else
+        um = used_memory;
     return um;
 }
 